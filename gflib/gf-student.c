@@ -3,8 +3,16 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "gf-student.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF_HAVE_X86 1
+#endif
+
 struct addrinfo *findAddrInfo(int ai_family, unsigned short portno, char *server) {
     struct addrinfo hints;
     struct addrinfo *res = NULL;
@@ -23,6 +31,398 @@ struct addrinfo *findAddrInfo(int ai_family, unsigned short portno, char *server
     return res;
 }
 
+// A fixed-size memcmp, compiled to a single word compare
+static int gf_is_header_end(const char *p) {
+    return memcmp(p, "\r\n\r\n", 4) == 0;
+}
+
+static ssize_t gf_find_header_end_scalar(const char *buffer, ssize_t i, ssize_t length) {
+    // memchr is vectorized by libc, so this stays fast without our own SIMD
+    while (i + 3 < length) {
+        const char *cr = memchr(buffer + i, '\r', length - 3 - i);
+        if (cr == NULL) {
+            return -1;
+        }
+        i = cr - buffer;
+        if (gf_is_header_end(cr)) {
+            return i;
+        }
+        i++;
+    }
+    return -1;
+}
+
+#ifdef GF_HAVE_X86
+// Matches all four delimiter bytes at once: lane k of the mask is set when
+// "\r\n\r\n" starts at p + k, so there are no false candidates to recheck.
+__attribute__((target("sse2")))
+static unsigned gf_match_sse2(const char *p) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    __m128i match = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), cr),
+                      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), lf)),
+        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 2)), cr),
+                      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 3)), lf)));
+    return _mm_movemask_epi8(match);
+}
+
+__attribute__((target("avx2")))
+static unsigned gf_match_avx2(const char *p) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    __m256i match = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), cr),
+                         _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 1)), lf)),
+        _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 2)), cr),
+                         _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 3)), lf)));
+    return _mm256_movemask_epi8(match);
+}
+
+// Headers are a few dozen bytes, so the tail matters as much as the loop:
+// rather than handing it to a narrower scan, each width ends with one more
+// vector flush with the end of the buffer.  It overlaps positions already
+// found not to match, so its first match is still the first one overall.
+__attribute__((target("sse2")))
+static ssize_t gf_find_header_end_sse2(const char *buffer, ssize_t i, ssize_t length) {
+    ssize_t start = i;
+    for (; i + 16 + 3 <= length; i += 16) {
+        unsigned mask = gf_match_sse2(buffer + i);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if (i + 3 < length && length - 19 >= start) {
+        unsigned mask = gf_match_sse2(buffer + length - 19);
+        return mask != 0 ? length - 19 + __builtin_ctz(mask) : -1;
+    }
+    return gf_find_header_end_scalar(buffer, i, length);
+}
+
+__attribute__((target("avx2")))
+static ssize_t gf_find_header_end_avx2(const char *buffer, ssize_t i, ssize_t length) {
+    ssize_t start = i;
+    for (; i + 32 + 3 <= length; i += 32) {
+        unsigned mask = gf_match_avx2(buffer + i);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if (i + 3 < length && length - 35 >= start) {
+        unsigned mask = gf_match_avx2(buffer + length - 35);
+        return mask != 0 ? length - 35 + __builtin_ctz(mask) : -1;
+    }
+    return gf_find_header_end_sse2(buffer, i, length);
+}
+#endif
+
+ssize_t gf_find_header_end(const char *buffer, ssize_t start, ssize_t length) {
+    if (start < 0) start = 0;
+#ifdef GF_HAVE_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return gf_find_header_end_avx2(buffer, start, length);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return gf_find_header_end_sse2(buffer, start, length);
+    }
+#endif
+    return gf_find_header_end_scalar(buffer, start, length);
+}
+
+int gf_parse_number(const char *buffer, ssize_t *pos, ssize_t end, size_t *value) {
+    ssize_t i = *pos;
+    size_t result = 0;
+
+    while (i < end && buffer[i] != ' ') {
+        if (buffer[i] < '0' || buffer[i] > '9') {
+            return -1;
+        }
+        result = result * 10 + (buffer[i] - '0');
+        i++;
+    }
+    if (i == *pos) {
+        return -1;
+    }
+    *value = result;
+    *pos = i;
+    return 0;
+}
+
+void gf_header_init(gf_header_parser_t *parser, char *buffer, size_t capacity) {
+    parser->buffer = buffer;
+    parser->capacity = capacity;
+    gf_header_reset(parser);
+}
+
+void gf_header_reset(gf_header_parser_t *parser) {
+    parser->length = 0;
+    parser->scanned = 0;
+    parser->header_length = 0;
+}
+
+char *gf_header_space(gf_header_parser_t *parser, size_t *room) {
+    *room = parser->capacity - parser->length;
+    return parser->buffer + parser->length;
+}
+
+gf_header_status_t gf_header_feed(gf_header_parser_t *parser, size_t received) {
+    parser->length += received;
+    if (parser->header_length > 0) {
+        return GF_HEADER_COMPLETE;
+    }
+
+    // The delimiter may straddle the previous scan's end
+    ssize_t end = gf_find_header_end(parser->buffer, (ssize_t) parser->scanned - 3, parser->length);
+    if (end >= 0) {
+        parser->header_length = end + 4;
+        return GF_HEADER_COMPLETE;
+    }
+    parser->scanned = parser->length;
+    return (parser->length == parser->capacity) ? GF_HEADER_INVALID : GF_HEADER_NEED_MORE;
+}
+
+char *gf_header_rest(gf_header_parser_t *parser, size_t *length) {
+    *length = parser->length - parser->header_length;
+    return parser->buffer + parser->header_length;
+}
+
+void gf_header_consume(gf_header_parser_t *parser, size_t length) {
+    parser->length -= length;
+    memmove(parser->buffer, parser->buffer + length, parser->length);
+    parser->scanned = 0;
+    parser->header_length = 0;
+}
+
+int gf_uring_init(gf_uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        gf_uring_destroy(ring);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+struct io_uring_sqe *gf_uring_get_sqe(gf_uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+        if (gf_uring_submit(ring, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+int gf_uring_submit(gf_uring_t *ring, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (1) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, wait_nr, flags, NULL, 0);
+        if (submitted >= 0) {
+            ring->sq_pending -= (submitted < ring->sq_pending) ? submitted : ring->sq_pending;
+            return submitted;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+struct io_uring_cqe *gf_uring_peek_cqe(gf_uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void gf_uring_cqe_seen(gf_uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void gf_uring_destroy(gf_uring_t *ring) {
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if (ring->fd >= 0) close(ring->fd);
+    ring->fd = -1;
+}
+
+// Free objects start with this header.  A batch is a chain of GF_POOL_BATCH
+// objects through next, and batches in the depot are chained through the
+// next_batch of their first object.
+typedef struct gf_pool_free_t {
+    struct gf_pool_free_t *next;
+    struct gf_pool_free_t *next_batch;
+} gf_pool_free_t;
+
+typedef struct {
+    gf_pool_t *pool;
+    gf_pool_free_t *head;
+    int count;
+} gf_pool_cache_t;
+
+// Slabs are kept on a list ahead of their objects, aligned like malloc
+#define GF_POOL_SLAB_HEADER 16
+
+static void gf_pool_give_batch(gf_pool_t *pool, gf_pool_free_t *batch) {
+    pthread_mutex_lock(&pool->lock);
+    batch->next_batch = pool->batches;
+    pool->batches = batch;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns whatever an exiting thread still caches to the depot
+static void gf_pool_cache_free(void *arg) {
+    gf_pool_cache_t *cache = arg;
+    if (cache->head != NULL) {
+        gf_pool_give_batch(cache->pool, cache->head);
+    }
+    free(cache);
+}
+
+static gf_pool_cache_t *gf_pool_cache(gf_pool_t *pool) {
+    gf_pool_cache_t *cache = pthread_getspecific(pool->key);
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(gf_pool_cache_t));
+        if (cache == NULL) {
+            return NULL;
+        }
+        cache->pool = pool;
+        if (pthread_setspecific(pool->key, cache) != 0) {
+            free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+// Refills an empty cache from the depot, or from a new slab
+static int gf_pool_refill(gf_pool_t *pool, gf_pool_cache_t *cache) {
+    pthread_mutex_lock(&pool->lock);
+    gf_pool_free_t *batch = pool->batches;
+    if (batch != NULL) {
+        pool->batches = batch->next_batch;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (batch != NULL) {
+        cache->head = batch;
+        cache->count = 0;
+        for (gf_pool_free_t *obj = batch; obj != NULL; obj = obj->next) {
+            cache->count++;
+        }
+        return 0;
+    }
+
+    char *slab = malloc(GF_POOL_SLAB_HEADER + pool->size * GF_POOL_BATCH);
+    if (slab == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = GF_POOL_BATCH - 1; i >= 0; i--) {
+        gf_pool_free_t *obj = (gf_pool_free_t *) (slab + GF_POOL_SLAB_HEADER + i * pool->size);
+        obj->next = cache->head;
+        cache->head = obj;
+    }
+    cache->count = GF_POOL_BATCH;
+    return 0;
+}
+
+int gf_pool_init(gf_pool_t *pool, size_t size) {
+    if (size < sizeof(gf_pool_free_t)) {
+        size = sizeof(gf_pool_free_t);
+    }
+    pool->size = (size + 15) & ~(size_t) 15;
+    pool->batches = NULL;
+    pool->slabs = NULL;
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        return -1;
+    }
+    return pthread_key_create(&pool->key, gf_pool_cache_free) == 0 ? 0 : -1;
+}
+
+void *gf_pool_get(gf_pool_t *pool) {
+    gf_pool_cache_t *cache = gf_pool_cache(pool);
+    if (cache == NULL) {
+        return NULL;
+    }
+    if (cache->head == NULL && gf_pool_refill(pool, cache) != 0) {
+        return NULL;
+    }
 
+    gf_pool_free_t *obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    return obj;
+}
+
+void gf_pool_put(gf_pool_t *pool, void *ptr) {
+    gf_pool_cache_t *cache = gf_pool_cache(pool);
+    gf_pool_free_t *obj = ptr;
+
+    // Without a cache of its own, the object goes to the depot by itself
+    if (cache == NULL) {
+        obj->next = NULL;
+        gf_pool_give_batch(pool, obj);
+        return;
+    }
 
+    obj->next = cache->head;
+    cache->head = obj;
+    cache->count++;
 
+    // Keep one batch at hand and pass the one behind it on
+    if (cache->count == 2 * GF_POOL_BATCH) {
+        gf_pool_free_t *last = cache->head;
+        for (int i = 1; i < GF_POOL_BATCH; i++) {
+            last = last->next;
+        }
+        gf_pool_free_t *batch = last->next;
+        last->next = NULL;
+        cache->count = GF_POOL_BATCH;
+        gf_pool_give_batch(pool, batch);
+    }
+}
@@ -5,6 +5,7 @@
 #define __GF_STUDENT_H__
 
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -17,10 +18,156 @@
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 
 
 // Finding the correct address for socket
 struct addrinfo *findAddrInfo(int ai_family, unsigned short portno, char *server);
 
+// Minimal io_uring instance, driven through the raw system calls.  Callers
+// fill SQEs from gf_uring_get_sqe, push them with gf_uring_submit and walk
+// completions with gf_uring_peek_cqe / gf_uring_cqe_seen.  Not thread-safe.
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_pending;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+} gf_uring_t;
+
+// Sets up a ring with room for entries submissions; returns 0 or -1
+int gf_uring_init(gf_uring_t *ring, unsigned entries);
+
+// Returns a zeroed SQE, submitting queued ones first if the ring is full
+struct io_uring_sqe *gf_uring_get_sqe(gf_uring_t *ring);
+
+// Submits queued SQEs and waits for at least wait_nr completions
+int gf_uring_submit(gf_uring_t *ring, unsigned wait_nr);
+
+// Returns the oldest unseen completion, or NULL if there is none
+struct io_uring_cqe *gf_uring_peek_cqe(gf_uring_t *ring);
+
+// Marks the completion returned by gf_uring_peek_cqe as consumed
+void gf_uring_cqe_seen(gf_uring_t *ring);
+
+void gf_uring_destroy(gf_uring_t *ring);
+
+// Compares the len bytes at p with token, for len from 1 to 16, by loading
+// both as two possibly overlapping words instead of walking bytes.  The
+// fixed-size memcpys compile to plain unaligned loads.  Inline, since the
+// protocol tokens it serves are shorter than a call.
+static inline int gf_token_equal(const char *p, const char *token, size_t len) {
+    if (len >= 8) {
+        uint64_t a, b, c, d;
+        memcpy(&a, p, 8);
+        memcpy(&b, token, 8);
+        memcpy(&c, p + len - 8, 8);
+        memcpy(&d, token + len - 8, 8);
+        return ((a ^ b) | (c ^ d)) == 0;
+    }
+    if (len >= 4) {
+        uint32_t a, b, c, d;
+        memcpy(&a, p, 4);
+        memcpy(&b, token, 4);
+        memcpy(&c, p + len - 4, 4);
+        memcpy(&d, token + len - 4, 4);
+        return ((a ^ b) | (c ^ d)) == 0;
+    }
+    if (len >= 2) {
+        uint16_t a, b, c, d;
+        memcpy(&a, p, 2);
+        memcpy(&b, token, 2);
+        memcpy(&c, p + len - 2, 2);
+        memcpy(&d, token + len - 2, 2);
+        return ((a ^ b) | (c ^ d)) == 0;
+    }
+    return len == 0 || *p == *token;
+}
+
+// Returns the index of the "\r\n\r\n" ending a GETFILE header in the
+// first length bytes of buffer, looking from start on, or -1 if there is
+// none yet.  Uses AVX2 or SSE2 compares where the CPU has them.
+ssize_t gf_find_header_end(const char *buffer, ssize_t start, ssize_t length);
+
+// Incremental reader for one GETFILE header at a time, held per connection
+// over a caller-owned buffer.  Receive into gf_header_space and report the
+// bytes with gf_header_feed, which scans only what is new and tells whether
+// the header is complete.  Bytes behind the header (the start of a body, or
+// a pipelined request) are exposed in place by gf_header_rest and stay
+// buffered until gf_header_consume drops them.  Works the same over
+// blocking, non-blocking and completion-based sockets.
+typedef enum {
+    GF_HEADER_NEED_MORE,
+    GF_HEADER_COMPLETE,
+    GF_HEADER_INVALID   // the buffer filled up without a delimiter
+} gf_header_status_t;
+
+typedef struct {
+    char *buffer;
+    size_t capacity;
+    size_t length;          // buffered bytes
+    size_t scanned;         // bytes already searched for the delimiter
+    size_t header_length;   // including the delimiter, 0 until complete
+} gf_header_parser_t;
+
+void gf_header_init(gf_header_parser_t *parser, char *buffer, size_t capacity);
+
+// Drops everything buffered, for a new connection
+void gf_header_reset(gf_header_parser_t *parser);
+
+// Returns where to receive the next bytes and stores how many fit in room
+char *gf_header_space(gf_header_parser_t *parser, size_t *room);
+
+// Accounts for received bytes written at gf_header_space and looks for the
+// end of the header.  Feeding 0 bytes checks what is already buffered.
+gf_header_status_t gf_header_feed(gf_header_parser_t *parser, size_t received);
+
+// Returns the bytes buffered behind a complete header and stores their count
+char *gf_header_rest(gf_header_parser_t *parser, size_t *length);
+
+// Drops the first length buffered bytes, header included, and starts
+// looking for the next header in what is left
+void gf_header_consume(gf_header_parser_t *parser, size_t length);
+
+// Parses the decimal number starting at *pos, up to a space or end, and
+// moves *pos past it.  Returns -1 if there is no number there.
+int gf_parse_number(const char *buffer, ssize_t *pos, ssize_t end, size_t *value);
+
+// Pool of fixed-size objects.  Each thread keeps freed objects in its own
+// cache and hands them back to a shared depot GF_POOL_BATCH at a time, so
+// objects allocated on one thread and freed on another only touch the
+// depot lock once per batch.  Memory is never given back to malloc.
+#define GF_POOL_BATCH 32
+
+typedef struct {
+    size_t size;
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    void *batches;   // full batches, linked through their first object
+    void *slabs;
+} gf_pool_t;
+
+// Sets up a pool of objects of size bytes; returns 0 or -1
+int gf_pool_init(gf_pool_t *pool, size_t size);
+
+// Returns an uninitialized object, or NULL if memory runs out
+void *gf_pool_get(gf_pool_t *pool);
+
+// Returns an object obtained from gf_pool_get, from any thread
+void gf_pool_put(gf_pool_t *pool, void *obj);
+
 
  #endif // __GF_STUDENT_H__
@@ -1,26 +1,87 @@
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "gfclient-student.h"
 
 // Modify this file to implement the interface specified in
 // gfclient.h.
 
+#define GFC_BUFFER_SIZE 1024
+#define GFC_VERSION_MAX 64
+
+// A connection to one server.  Bytes read past the end of a response (the
+// start of the next pipelined response) stay in the buffer, tracked by the
+// header parser, for the next read; keepalive records whether the server
+// agreed to keep it open.
+struct gfcconn_t {
+    char *server;
+    unsigned short portno;
+    int sfd;
+    int keepalive;
+    gfcconn_t *next;
+    gf_header_parser_t parser;
+    char buffer[GFC_BUFFER_SIZE];
+};
+
 struct gfcrequest_t {
     char *server;
     unsigned short portno;
     char *path;
-    int sfd;
+    gfcconn_t *conn;
+    int keepalive;
     void (*writefunc)(void *data, size_t data_len, void *arg);
     void *writearg;
     gfstatus_t status;
     size_t fileLength;
     size_t bytesReceived;
+    int ranged;
+    size_t rangeOffset;
+    size_t rangeLength;
+    size_t totalLength;
+    char *ifVersion;
+    char version[GFC_VERSION_MAX];
+    int plain;      // sent without tokens, for a server that does not know them
+    int fallback;   // sent plain again after FILE_NOT_FOUND for the tokens
 };
 
-static void gfc_close_socket(gfcrequest_t *req) {
-    if (req && req->sfd >= 0) {
-        close(req->sfd);
-        req->sfd = -1;
+#define GFC_POOL_MAX_IDLE 64
+
+// Per (server, port) state shared by all requests between
+// gfc_global_init and gfc_global_cleanup: the resolved address list, the
+// connections the server kept open, waiting to be borrowed, and whether
+// the server only understands plain requests.
+typedef struct gfc_host_t {
+    char *server;
+    unsigned short portno;
+    int plain;
+    struct addrinfo *addr;
+    gfcconn_t *idle;
+    size_t nidle;
+    struct gfc_host_t *next;
+} gfc_host_t;
+
+static pthread_mutex_t gfc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static gfc_host_t *gfc_hosts = NULL;
+static int gfc_pool_ready = 0;
+
+static void gfc_conn_init(gfcconn_t *conn, const char *server, unsigned short port) {
+    conn->server = server ? strdup(server) : NULL;
+    conn->portno = port;
+    conn->sfd = -1;
+    conn->keepalive = 0;
+    conn->next = NULL;
+    gf_header_init(&conn->parser, conn->buffer, GFC_BUFFER_SIZE);
+}
+
+static void gfc_close_socket(gfcconn_t *conn) {
+    if (conn && conn->sfd >= 0) {
+        close(conn->sfd);
+        conn->sfd = -1;
+    }
+    if (conn) {
+        conn->keepalive = 0;
+        gf_header_reset(&conn->parser);
     }
 }
 
@@ -28,7 +89,6 @@ static void gfc_close_socket(gfcrequest_t *req) {
 void gfc_cleanup(gfcrequest_t **gfr) {
     if (gfr == NULL || *gfr == NULL) return;
     gfcrequest_t *req = *gfr;
-    gfc_close_socket(req);
     if (req->server) {
         free(req->server);
         req->server = NULL;
@@ -37,6 +97,7 @@ void gfc_cleanup(gfcrequest_t **gfr) {
         free(req->path);
         req->path = NULL;
     }
+    free(req->ifVersion);
     free(req);
     *gfr = NULL;
 }
@@ -49,18 +110,39 @@ size_t gfc_get_bytesreceived(gfcrequest_t **gfr) {
     return (*gfr)->bytesReceived;
 }
 
+size_t gfc_get_totallen(gfcrequest_t **gfr) {
+    return (*gfr)->totalLength;
+}
+
+size_t gfc_get_rangeoffset(gfcrequest_t **gfr) {
+    return (*gfr)->rangeOffset;
+}
+
+const char *gfc_get_version(gfcrequest_t **gfr) {
+    return (*gfr)->version;
+}
+
 gfcrequest_t *gfc_create() {
     gfcrequest_t *gfr = malloc(sizeof(gfcrequest_t));
 
     // Initialize fields to safe defaults
     gfr->server = NULL;
     gfr->path = NULL;
-    gfr->sfd = -1;
+    gfr->conn = NULL;
+    gfr->keepalive = 0;
     gfr->writefunc = NULL;
     gfr->writearg = NULL;
     gfr->status = GF_INVALID;
     gfr->fileLength = 0;
     gfr->bytesReceived = 0;
+    gfr->ranged = 0;
+    gfr->rangeOffset = 0;
+    gfr->rangeLength = 0;
+    gfr->totalLength = 0;
+    gfr->ifVersion = NULL;
+    gfr->version[0] = '\0';
+    gfr->plain = 0;
+    gfr->fallback = 0;
 
     return gfr;
 }
@@ -71,13 +153,166 @@ gfstatus_t gfc_get_status(gfcrequest_t **gfr) {
 }
 
 void gfc_global_init() {
+    gfc_hosts = NULL;
+    gfc_pool_ready = 1;
 }
 
 void gfc_global_cleanup() {
+    gfc_pool_ready = 0;
+    while (gfc_hosts != NULL) {
+        gfc_host_t *host = gfc_hosts;
+        gfc_hosts = host->next;
+        while (host->idle != NULL) {
+            gfcconn_t *conn = host->idle;
+            host->idle = conn->next;
+            gfc_conn_close(&conn);
+        }
+        if (host->addr) {
+            freeaddrinfo(host->addr);
+        }
+        free(host->server);
+        free(host);
+    }
+}
+
+// Must be called with gfc_pool_lock held.
+static gfc_host_t *gfc_host_find(const char *server, unsigned short port) {
+    for (gfc_host_t *host = gfc_hosts; host != NULL; host = host->next) {
+        if (host->portno == port && strcmp(host->server, server) == 0) {
+            return host;
+        }
+    }
+
+    gfc_host_t *host = malloc(sizeof(gfc_host_t));
+    host->server = strdup(server);
+    host->portno = port;
+    host->plain = 0;
+    host->addr = NULL;
+    host->idle = NULL;
+    host->nidle = 0;
+    host->next = gfc_hosts;
+    gfc_hosts = host;
+    return host;
+}
+
+// Returns the address list for the server, resolved at most once while the
+// global pool is set up.  *owned tells the caller whether to free it.
+static struct addrinfo *gfc_resolve(gfcconn_t *conn, int *owned) {
+    *owned = 1;
+    if (!gfc_pool_ready || conn->server == NULL) {
+        return findAddrInfo(AF_UNSPEC, conn->portno, conn->server);
+    }
+
+    pthread_mutex_lock(&gfc_pool_lock);
+    struct addrinfo *addr = gfc_host_find(conn->server, conn->portno)->addr;
+    pthread_mutex_unlock(&gfc_pool_lock);
+    if (addr != NULL) {
+        *owned = 0;
+        return addr;
+    }
+
+    // Resolve without holding the lock; failures are not cached
+    addr = findAddrInfo(AF_UNSPEC, conn->portno, conn->server);
+    if (addr == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&gfc_pool_lock);
+    gfc_host_t *host = gfc_host_find(conn->server, conn->portno);
+    if (host->addr == NULL) {
+        host->addr = addr;
+        *owned = 0;
+    }
+    pthread_mutex_unlock(&gfc_pool_lock);
+    return addr;
+}
+
+// Makes the request plain if the server is known not to take tokens.
+static void gfc_check_plain(gfcrequest_t *req, gfcconn_t *conn) {
+    if (req->plain || !gfc_pool_ready || conn->server == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&gfc_pool_lock);
+    req->plain = gfc_host_find(conn->server, conn->portno)->plain;
+    pthread_mutex_unlock(&gfc_pool_lock);
+}
+
+// Decides what a response says about the server's support for tokens.  An
+// old server reads the tokens after the path as part of it and answers
+// FILE_NOT_FOUND, without the KEEPALIVE echo a new server may add, so such
+// an answer to a request that carried tokens is worth one plain retry.
+// When the retry finds the file, the server is remembered as plain-only.
+// Returns 1 if the request should be sent again.
+static int gfc_retry_plain(gfcrequest_t *req, gfcconn_t *conn, int keepalive) {
+    if (req->fallback && req->status != GF_FILE_NOT_FOUND && gfc_pool_ready && conn->server) {
+        pthread_mutex_lock(&gfc_pool_lock);
+        gfc_host_find(conn->server, conn->portno)->plain = 1;
+        pthread_mutex_unlock(&gfc_pool_lock);
+    }
+    if (req->plain || req->status != GF_FILE_NOT_FOUND || conn->keepalive ||
+        !(keepalive || req->ranged || req->ifVersion)) {
+        return 0;
+    }
+    req->plain = 1;
+    req->fallback = 1;
+    return 1;
+}
+
+static gfcconn_t *gfc_pool_borrow(const char *server, unsigned short port) {
+    gfcconn_t *conn = NULL;
+
+    pthread_mutex_lock(&gfc_pool_lock);
+    gfc_host_t *host = gfc_host_find(server, port);
+    if (host->idle != NULL) {
+        conn = host->idle;
+        host->idle = conn->next;
+        host->nidle--;
+    }
+    pthread_mutex_unlock(&gfc_pool_lock);
+
+    if (conn == NULL) {
+        conn = gfc_conn_create(server, port);
+    }
+    conn->next = NULL;
+    return conn;
+}
+
+// Keeps the connection for later requests if the server left it open.
+static void gfc_pool_return(gfcconn_t *conn) {
+    if (conn->sfd >= 0) {
+        pthread_mutex_lock(&gfc_pool_lock);
+        gfc_host_t *host = gfc_host_find(conn->server, conn->portno);
+        if (host->nidle < GFC_POOL_MAX_IDLE) {
+            conn->next = host->idle;
+            host->idle = conn;
+            host->nidle++;
+            conn = NULL;
+        }
+        pthread_mutex_unlock(&gfc_pool_lock);
+    }
+    gfc_conn_close(&conn);
+}
+
+gfcconn_t *gfc_conn_create(const char *server, unsigned short port) {
+    gfcconn_t *conn = malloc(sizeof(gfcconn_t));
+    gfc_conn_init(conn, server, port);
+    return conn;
+}
+
+void gfc_conn_close(gfcconn_t **conn) {
+    if (conn == NULL || *conn == NULL) return;
+    gfc_close_socket(*conn);
+    free((*conn)->server);
+    free(*conn);
+    *conn = NULL;
+}
+
+void gfc_set_conn(gfcrequest_t **gfr, gfcconn_t *conn) {
+    (*gfr)->conn = conn;
 }
 
-int establishConnection(gfcrequest_t **gfr) {
-    struct addrinfo *addr = findAddrInfo(AF_UNSPEC, (*gfr)->portno, (*gfr)->server);
+int establishConnection(gfcconn_t *conn) {
+    int owned;
+    struct addrinfo *addr = gfc_resolve(conn, &owned);
     struct addrinfo *rp;
     int sfd = -1;
     int connected = 0;
@@ -95,162 +330,612 @@ int establishConnection(gfcrequest_t **gfr) {
         sfd = -1;
     }
 
-    if (addr)
+    if (addr && owned)
         freeaddrinfo(addr);
 
     if (!connected) {
         fprintf(stderr, "Connection Failed!\n");
-        (*gfr)->status = GF_INVALID;
-        (*gfr)->sfd = -1;
+        conn->sfd = -1;
         return -1;
     }
-    (*gfr)->sfd = sfd;
+    conn->sfd = sfd;
+    gf_header_reset(&conn->parser);
     return 0;
 }
 
-int gfc_perform(gfcrequest_t **gfr) {
-    // Create the request message first
-    char buffer[1024];
-    sprintf(buffer, "GETFILE GET %s\r\n\r\n", (*gfr)->path);
+// Renders "GETFILE GET <path>\r\n\r\n" into buffer, with the requested
+// range and the version the caller has if there are any ("-" for none
+// yet, which still asks for the file's version), asking for the
+// connection to be kept open when keepalive is set.  A plain request
+// carries none of these tokens.  Returns its length, or -1 if it does not
+// fit.
+static int gfc_render_request(gfcrequest_t *req, int keepalive, char *buffer, size_t size) {
+    if (req->plain) {
+        int headerLength = snprintf(buffer, size, "GETFILE GET %s\r\n\r\n", req->path);
+        if (headerLength >= size) {
+            fprintf(stderr, "%s @ %d: request path too long\n", __FILE__, __LINE__);
+            return -1;
+        }
+        return headerLength;
+    }
 
-    if (establishConnection(gfr) == -1) {
-        gfc_close_socket(*gfr);
+    char range[64] = "";
+    if (req->ranged) {
+        snprintf(range, sizeof(range), " RANGE %zu %zu", req->rangeOffset, req->rangeLength);
+    }
+    int headerLength = snprintf(buffer, size, "GETFILE GET %s%s%s%s%s\r\n\r\n",
+                                req->path, range, req->ifVersion ? " IFVERSION " : "",
+                                req->ifVersion ? (req->ifVersion[0] ? req->ifVersion : "-") : "", keepalive ? " KEEPALIVE" : "");
+    if (headerLength >= size) {
+        fprintf(stderr, "%s @ %d: request path too long\n", __FILE__, __LINE__);
         return -1;
-    };
+    }
+    return headerLength;
+}
+
+// Sends the request, asking for the connection to be kept open when it runs
+// over a persistent connection.
+static int gfc_send_request(gfcrequest_t *req, gfcconn_t *conn, int keepalive) {
+    char buffer[GFC_BUFFER_SIZE];
+    gfc_check_plain(req, conn);
+    int headerLength = gfc_render_request(req, keepalive, buffer, sizeof(buffer));
+    if (headerLength == -1) {
+        return -1;
+    }
 
     // Send out the header to server/client
     ssize_t sent = 0;
-    ssize_t headerLength = strlen(buffer);
-
     while (sent < headerLength) {
-        ssize_t currSent = send((*gfr)->sfd, buffer + sent, headerLength - sent, 0);
+        ssize_t currSent = send(conn->sfd, buffer + sent, headerLength - sent, MSG_NOSIGNAL);
         if (currSent == -1) {
             fprintf(stderr, "%s @ %d: send failed\n", __FILE__, __LINE__);
-            gfc_close_socket(*gfr);
             return -1;
         }
         sent += currSent;
     }
+    return 0;
+}
 
-    // fprintf(stdout, "Sent Header: %lu\n", headerLength);
-    memset(buffer, 0, sizeof(buffer));
-
-    // Receive header response from server
-    ssize_t prevLength = 0;
-    ssize_t received = 0;
-    ssize_t header_end = 0;
-    int header_found = 0;
-    while (header_found == 0) {
-        received = recv((*gfr)->sfd, buffer + prevLength, sizeof(buffer) - prevLength, 0);
-
-        if (received == 0) {
-            break;
-        }
-        if (received == -1) {
-            fprintf(stderr, "%s @ %d: receive failed\n", __FILE__, __LINE__);
-            gfc_close_socket(*gfr);
-            return -1;
-        }
-        // scan the current buffer to delimiter
-        ssize_t currentLength = prevLength + received;
-        ssize_t start = (prevLength >= 3) ? (prevLength - 3) : 0;
-        for (ssize_t i = start; i + 3 < currentLength; i++) {
-            if (buffer[i] == '\r' &&
-                buffer[i + 1] == '\n' &&
-                buffer[i + 2] == '\r' &&
-                buffer[i + 3] == '\n') {
-                // Found it!
-                header_end = i; // index of the '\r' that starts the sequence
-                header_found = 1;
-                break;
-            }
-        }
-        prevLength = currentLength;
+// Delivers the start of the body straight from behind the parsed header,
+// then drops both from the connection buffer, keeping whatever follows them
+// for the next response.
+static void gfc_consume_buffered(gfcrequest_t *req, gfcconn_t *conn, int has_body) {
+    size_t buffered;
+    char *rest = gf_header_rest(&conn->parser, &buffered);
+    size_t remaining = has_body ? req->fileLength - req->bytesReceived : 0;
+    size_t take = (buffered < remaining) ? buffered : remaining;
+
+    if (take > 0 && req->writefunc) {
+        req->writefunc(rest, take, req->writearg);
+        // fprintf(stdout, "Wrote Progress: %lu/%lu\n", req->bytesReceived, req->fileLength);
     }
-    // fprintf(stdout, "Received Header: %.*s\n", (int) header_end, buffer);
-    // fprintf(stdout, "Leftover: %s\n", buffer + header_end + 4);
+    req->bytesReceived += take;
+    gf_header_consume(&conn->parser, conn->parser.header_length + take);
+}
+
+// Parses the complete response header at the start of the connection
+// buffer.  Returns 1 if a body follows, 0 if not, or -1 if the header is
+// malformed.
+static int gfc_parse_header(gfcrequest_t *req, gfcconn_t *conn) {
+    char *buffer = conn->buffer;
+    ssize_t header_end = conn->parser.header_length - 4;
 
     // Deal with the header from 0 to header_end - 1
     // 0 to 6: GETFILE
-    ssize_t start = 0;
-    if (memcmp(buffer, "GETFILE", 7) != 0) {
-        (*gfr)->status = GF_INVALID;
-        gfc_close_socket(*gfr);
+    if (!gf_token_equal(buffer, "GETFILE ", 8)) {
+        req->status = GF_INVALID;
         return -1;
     }
-    // 8 to x: status
-    start = 8;
+
+    // A trailing KEEPALIVE token means the server keeps the connection open
+    conn->keepalive = 0;
+    if (header_end >= 18 && gf_token_equal(buffer + header_end - 10, " KEEPALIVE", 10)) {
+        conn->keepalive = 1;
+        header_end -= 10;
+    }
+
+    // 8 to x: status, told apart by length and then compared a word at a time
+    ssize_t start = 8;
     ssize_t end = 8;
     while (end < header_end && buffer[end] != ' ') {
         end++;
     }
     ssize_t tokenLength = end - start;
-    if (tokenLength == 2 && memcmp(buffer + start, "OK", 2) == 0) {
-        (*gfr)->status = GF_OK;
-    } else if (tokenLength == 14 && memcmp(buffer + start, "FILE_NOT_FOUND", 14) == 0) {
-        (*gfr)->status = GF_FILE_NOT_FOUND;
-        gfc_close_socket(*gfr);
-        return 0;
-    } else if (tokenLength == 5 && memcmp(buffer + start, "ERROR", 5) == 0) {
-        (*gfr)->status = GF_ERROR;
-        gfc_close_socket(*gfr);
-        return 0;
+    int has_body = 0;
+    if (tokenLength == 2 && gf_token_equal(buffer + start, "OK", 2)) {
+        req->status = GF_OK;
+        has_body = 1;
+    } else if (tokenLength == 14 && gf_token_equal(buffer + start, "FILE_NOT_FOUND", 14)) {
+        req->status = GF_FILE_NOT_FOUND;
+    } else if (tokenLength == 5 && gf_token_equal(buffer + start, "ERROR", 5)) {
+        req->status = GF_ERROR;
+    } else if (tokenLength == 12 && gf_token_equal(buffer + start, "NOT_MODIFIED", 12)) {
+        req->status = GF_NOT_MODIFIED;
     } else {
-        (*gfr)->status = GF_INVALID;
-        gfc_close_socket(*gfr);
+        req->status = GF_INVALID;
         return -1;
     }
-    // x+1 to header_end - 1: length
-    start = end + 1;
-    for (size_t i = start; i < header_end; i++) {
-        char c = buffer[i];
-        if (c < '0' || c > '9') {
-            (*gfr)->status = GF_INVALID;
-            gfc_close_socket(*gfr);
+
+    req->version[0] = '\0';
+    if (has_body) {
+        // x+1 to header_end - 1: length, then " RANGE <offset> <total>" for
+        // a range request and " VERSION <version>" if the server sent one
+        ssize_t i = end + 1;
+        if (gf_parse_number(buffer, &i, header_end, &req->fileLength) == -1) {
+            req->status = GF_INVALID;
             return -1;
         }
-        (*gfr)->fileLength = (*gfr)->fileLength * 10 + (c - '0');
+        req->totalLength = req->fileLength;
+        if (req->ranged) {
+            req->rangeOffset = 0;
+        }
+        if (i < header_end && header_end - i >= 7 && gf_token_equal(buffer + i, " RANGE ", 7)) {
+            i += 7;
+            if (gf_parse_number(buffer, &i, header_end, &req->rangeOffset) == -1 ||
+                i++ == header_end ||
+                gf_parse_number(buffer, &i, header_end, &req->totalLength) == -1) {
+                req->status = GF_INVALID;
+                return -1;
+            }
+        }
+        if (i < header_end && header_end - i >= 9 && gf_token_equal(buffer + i, " VERSION ", 9)) {
+            ssize_t length = header_end - i - 9;
+            if (length == 0 || length >= GFC_VERSION_MAX) {
+                req->status = GF_INVALID;
+                return -1;
+            }
+            memcpy(req->version, buffer + i + 9, length);
+            req->version[length] = '\0';
+            i = header_end;
+        }
+        if (i != header_end) {
+            req->status = GF_INVALID;
+            return -1;
+        }
+    } else if (end != header_end) {
+        req->status = GF_INVALID;
+        return -1;
     }
-    // fprintf(stdout, "Length: %lu\n", (*gfr)->fileLength);
+    // fprintf(stdout, "Length: %lu\n", req->fileLength);
 
-    // Deal with the rest content in the buffer
-    ssize_t leftover = prevLength - (header_end + 4); // 4 = "\r\n\r\n"
-    (*gfr)->bytesReceived = (leftover > 0) ? leftover : 0;
+    req->bytesReceived = 0;
+    return has_body;
+}
 
-    if ((*gfr)->bytesReceived > 0 && (*gfr)->writefunc) {
-        (*gfr)->writefunc(buffer + header_end + 4, (*gfr)->bytesReceived, (*gfr)->writearg);
-        // fprintf(stdout, "Wrote Progress: %lu/%lu\n", (*gfr)->bytesReceived, (*gfr)->fileLength);
+// Reads one response off the connection.  Returns 0 or -1 following the
+// gfc_perform contract; on -1 the connection is no longer usable.
+static int gfc_read_response(gfcrequest_t *req, gfcconn_t *conn) {
+    char *buffer = conn->buffer;
+
+    // Receive header response from server; a pipelined response may
+    // already be buffered
+    gf_header_status_t status = gf_header_feed(&conn->parser, 0);
+    while (status == GF_HEADER_NEED_MORE) {
+        size_t room;
+        char *space = gf_header_space(&conn->parser, &room);
+        ssize_t received = recv(conn->sfd, space, room, 0);
+        if (received == 0) {
+            break;
+        }
+        if (received == -1) {
+            fprintf(stderr, "%s @ %d: receive failed\n", __FILE__, __LINE__);
+            return -1;
+        }
+        status = gf_header_feed(&conn->parser, received);
+    }
+    // fprintf(stdout, "Received Header: %.*s\n", (int) conn->parser.header_length, buffer);
+
+    if (status != GF_HEADER_COMPLETE) {
+        req->status = GF_INVALID;
+        return -1;
+    }
+    int has_body = gfc_parse_header(req, conn);
+    if (has_body < 0) {
+        return has_body;
+    }
+    gfc_consume_buffered(req, conn, has_body);
+    if (has_body == 0) {
+        return 0;
     }
 
-    // Repeated receive chunks and write
-    while ((*gfr)->bytesReceived < (*gfr)->fileLength) {
-        ssize_t currRecv = recv((*gfr)->sfd, buffer, 1024, 0);
+    // Repeated receive chunks and write, never reading past this body
+    while (req->bytesReceived < req->fileLength) {
+        size_t remaining = req->fileLength - req->bytesReceived;
+        ssize_t currRecv = recv(conn->sfd, buffer,
+                                remaining < GFC_BUFFER_SIZE ? remaining : GFC_BUFFER_SIZE, 0);
         if (currRecv == -1) {
             fprintf(stderr, "%s @ %d: recv failed\n", __FILE__, __LINE__);
-            (*gfr)->status = GF_INVALID;
-            gfc_close_socket(*gfr);
+            req->status = GF_INVALID;
             return -1;
         }
         if (currRecv == 0) {
             // connection closed early
-            fprintf(stderr, "Connection closed early, bytes received: %lu, fileLength: %lu\n", (*gfr)->bytesReceived,
-                    (*gfr)->fileLength);
-            gfc_close_socket(*gfr);
+            fprintf(stderr, "Connection closed early, bytes received: %lu, fileLength: %lu\n", req->bytesReceived,
+                    req->fileLength);
             return -1;
         }
 
-        (*gfr)->bytesReceived += currRecv;
-        if ((*gfr)->writefunc) {
-            (*gfr)->writefunc(buffer, currRecv, (*gfr)->writearg);
-            // fprintf(stdout, "Wrote Progress: %lu/%lu\n", (*gfr)->bytesReceived, (*gfr)->fileLength);
+        req->bytesReceived += currRecv;
+        if (req->writefunc) {
+            req->writefunc(buffer, currRecv, req->writearg);
+            // fprintf(stdout, "Wrote Progress: %lu/%lu\n", req->bytesReceived, req->fileLength);
         }
     }
 
     // fprintf(stdout, "File Transfer Finished!\n");
-    gfc_close_socket(*gfr);
     return 0;
 }
 
+// Runs requests over a persistent connection, connecting first if needed.
+// Once the server has granted keep-alive on the connection, all remaining
+// requests are written back to back before any response is read, so the
+// server can work through them without waiting on the network; until then
+// only one request is in flight, since a server that closes after each
+// response would drop the others.  A connection that was idle may have been
+// closed by the server in the meantime; if nothing at all came back on such
+// a connection, its requests are retried on a fresh one.
+static int gfc_perform_on(gfcrequest_t **gfrs, size_t n, gfcconn_t *conn) {
+    size_t done = 0;
+
+    while (done < n) {
+        int reused = (conn->sfd >= 0);
+        if (!reused && establishConnection(conn) == -1) {
+            break;
+        }
+
+        size_t batch = reused ? n - done : 1;
+        size_t sent = 0;
+        while (sent < batch && gfc_send_request(gfrs[done + sent], conn, 1) == 0) {
+            sent++;
+        }
+        if (sent < batch) {
+            gfc_close_socket(conn);
+            if (reused) {
+                continue;
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < batch; i++) {
+            if (gfc_read_response(gfrs[done], conn) == -1) {
+                gfc_close_socket(conn);
+                if (reused && i == 0 && gfrs[done]->bytesReceived == 0) {
+                    break;  // stale connection, retry on a fresh one
+                }
+                for (size_t j = done; j < n; j++) {
+                    gfrs[j]->status = GF_INVALID;
+                }
+                return -1;
+            }
+            if (gfc_retry_plain(gfrs[done], conn, 1)) {
+                gfc_close_socket(conn);
+                break;
+            }
+            done++;
+            if (!conn->keepalive) {
+                // The server closes after this response; reconnect for the rest
+                gfc_close_socket(conn);
+                break;
+            }
+        }
+    }
+
+    if (done < n) {
+        for (size_t j = done; j < n; j++) {
+            gfrs[j]->status = GF_INVALID;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int gfc_perform_pipeline(gfcrequest_t **gfrs, size_t n, gfcconn_t *conn) {
+    if (n == 0) {
+        return 0;
+    }
+    return gfc_perform_on(gfrs, n, conn);
+}
+
+int gfc_perform(gfcrequest_t **gfr) {
+    if ((*gfr)->conn) {
+        return gfc_perform_on(gfr, 1, (*gfr)->conn);
+    }
+
+    // Between gfc_global_init and gfc_global_cleanup, requests that asked
+    // for keep-alive borrow warm connections from the pool and give them
+    // back if they stay open
+    if (gfc_pool_ready && (*gfr)->keepalive && (*gfr)->server) {
+        gfcconn_t *conn = gfc_pool_borrow((*gfr)->server, (*gfr)->portno);
+        int rc = gfc_perform_on(gfr, 1, conn);
+        gfc_pool_return(conn);
+        return rc;
+    }
+
+    gfcconn_t conn;
+    gfc_conn_init(&conn, (*gfr)->server, (*gfr)->portno);
+    int rc;
+    while (1) {
+        rc = -1;
+        if (establishConnection(&conn) == -1) {
+            (*gfr)->status = GF_INVALID;
+        } else if (gfc_send_request(*gfr, &conn, 0) == 0) {
+            rc = gfc_read_response(*gfr, &conn);
+        }
+        int retry = (rc == 0 && gfc_retry_plain(*gfr, &conn, 0));
+        gfc_close_socket(&conn);
+        if (!retry) {
+            break;
+        }
+    }
+    free(conn.server);
+    return rc;
+}
+
+// One request in flight on a gfcmulti_t.  Each transfer has its own
+// connection and at most one operation queued on the ring at a time; the
+// operation's user_data points back at the transfer.
+typedef enum {
+    GFC_XFER_CONNECT,
+    GFC_XFER_SEND,
+    GFC_XFER_HEADER,
+    GFC_XFER_BODY,
+} gfc_xfer_state_t;
+
+typedef struct gfc_transfer_t {
+    gfcrequest_t *req;
+    gfcconn_t conn;
+    gfc_xfer_state_t state;
+    struct addrinfo *addr;
+    struct addrinfo *rp;
+    int owned;
+    size_t request_length;
+    size_t sent;
+    void (*donefunc)(gfcrequest_t **gfr, int result, void *donearg);
+    void *donearg;
+} gfc_transfer_t;
+
+struct gfcmulti_t {
+    gf_uring_t ring;
+    size_t in_flight;
+};
+
+gfcmulti_t *gfc_multi_create(unsigned int queue_depth) {
+    gfcmulti_t *multi = malloc(sizeof(gfcmulti_t));
+    if (gf_uring_init(&multi->ring, queue_depth ? queue_depth : 1) == -1) {
+        fprintf(stderr, "%s @ %d: io_uring_setup failed\n", __FILE__, __LINE__);
+        free(multi);
+        return NULL;
+    }
+    multi->in_flight = 0;
+    return multi;
+}
+
+size_t gfc_multi_pending(gfcmulti_t *multi) {
+    return multi->in_flight;
+}
+
+static void gfc_xfer_done(gfcmulti_t *multi, gfc_transfer_t *xfer, int result) {
+    if (result < 0) {
+        xfer->req->status = GF_INVALID;
+    }
+    gfc_close_socket(&xfer->conn);
+    free(xfer->conn.server);
+    if (xfer->addr && xfer->owned) {
+        freeaddrinfo(xfer->addr);
+    }
+    multi->in_flight--;
+
+    gfcrequest_t *req = xfer->req;
+    void (*donefunc)(gfcrequest_t **, int, void *) = xfer->donefunc;
+    void *donearg = xfer->donearg;
+    free(xfer);
+    if (donefunc) {
+        donefunc(&req, result, donearg);
+    }
+}
+
+// Queues the operation that moves the transfer on from its current state.
+static int gfc_xfer_arm(gfcmulti_t *multi, gfc_transfer_t *xfer) {
+    struct io_uring_sqe *sqe = gf_uring_get_sqe(&multi->ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "%s @ %d: submission queue full\n", __FILE__, __LINE__);
+        return -1;
+    }
+    sqe->fd = xfer->conn.sfd;
+    sqe->user_data = (unsigned long) xfer;
+
+    gfcconn_t *conn = &xfer->conn;
+    switch (xfer->state) {
+        case GFC_XFER_CONNECT:
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->addr = (unsigned long) xfer->rp->ai_addr;
+            sqe->off = xfer->rp->ai_addrlen;
+            break;
+        case GFC_XFER_SEND:
+            // The request is rendered into the connection buffer until sent
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (unsigned long) (conn->buffer + xfer->sent);
+            sqe->len = xfer->request_length - xfer->sent;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            break;
+        case GFC_XFER_HEADER: {
+            size_t room;
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = (unsigned long) gf_header_space(&conn->parser, &room);
+            sqe->len = room;
+            break;
+        }
+        case GFC_XFER_BODY: {
+            size_t remaining = xfer->req->fileLength - xfer->req->bytesReceived;
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = (unsigned long) conn->buffer;
+            sqe->len = remaining < GFC_BUFFER_SIZE ? remaining : GFC_BUFFER_SIZE;
+            break;
+        }
+    }
+    return 0;
+}
+
+// Opens a socket for the next candidate address and queues its connect.
+static int gfc_xfer_connect(gfcmulti_t *multi, gfc_transfer_t *xfer) {
+    for (; xfer->rp != NULL; xfer->rp = xfer->rp->ai_next) {
+        xfer->conn.sfd = socket(xfer->rp->ai_family, xfer->rp->ai_socktype | SOCK_CLOEXEC,
+                                xfer->rp->ai_protocol);
+        if (xfer->conn.sfd != -1) {
+            xfer->state = GFC_XFER_CONNECT;
+            return gfc_xfer_arm(multi, xfer);
+        }
+    }
+    fprintf(stderr, "Connection Failed!\n");
+    return -1;
+}
+
+// Handles the completion of the transfer's pending operation.  Returns 1
+// once the transfer is over, 0 if it has queued its next operation, and -1
+// on failure.
+static int gfc_xfer_step(gfcmulti_t *multi, gfc_transfer_t *xfer, int res) {
+    gfcrequest_t *req = xfer->req;
+    gfcconn_t *conn = &xfer->conn;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        return gfc_xfer_arm(multi, xfer);
+    }
+
+    switch (xfer->state) {
+        case GFC_XFER_CONNECT:
+            if (res < 0) {
+                // Try the next address, as establishConnection does
+                gfc_close_socket(conn);
+                xfer->rp = xfer->rp->ai_next;
+                return gfc_xfer_connect(multi, xfer);
+            }
+            xfer->state = GFC_XFER_SEND;
+            return gfc_xfer_arm(multi, xfer);
+
+        case GFC_XFER_SEND:
+            if (res < 0) {
+                fprintf(stderr, "%s @ %d: send failed\n", __FILE__, __LINE__);
+                return -1;
+            }
+            xfer->sent += res;
+            if (xfer->sent == xfer->request_length) {
+                gf_header_reset(&conn->parser);
+                xfer->state = GFC_XFER_HEADER;
+            }
+            return gfc_xfer_arm(multi, xfer);
+
+        case GFC_XFER_HEADER: {
+            if (res < 0) {
+                fprintf(stderr, "%s @ %d: receive failed\n", __FILE__, __LINE__);
+                return -1;
+            }
+            gf_header_status_t status = gf_header_feed(&conn->parser, res);
+            if (status != GF_HEADER_COMPLETE) {
+                if (res == 0 || status == GF_HEADER_INVALID) {
+                    req->status = GF_INVALID;
+                    return -1;
+                }
+                return gfc_xfer_arm(multi, xfer);
+            }
+            int has_body = gfc_parse_header(req, conn);
+            if (has_body < 0) {
+                return -1;
+            }
+            gfc_consume_buffered(req, conn, has_body);
+            if (has_body == 0 || req->bytesReceived == req->fileLength) {
+                return 1;
+            }
+            xfer->state = GFC_XFER_BODY;
+            return gfc_xfer_arm(multi, xfer);
+        }
+
+        case GFC_XFER_BODY:
+            if (res < 0) {
+                fprintf(stderr, "%s @ %d: recv failed\n", __FILE__, __LINE__);
+                return -1;
+            }
+            if (res == 0) {
+                fprintf(stderr, "Connection closed early, bytes received: %lu, fileLength: %lu\n", req->bytesReceived,
+                        req->fileLength);
+                return -1;
+            }
+            req->bytesReceived += res;
+            if (req->writefunc) {
+                req->writefunc(conn->buffer, res, req->writearg);
+            }
+            if (req->bytesReceived == req->fileLength) {
+                return 1;
+            }
+            return gfc_xfer_arm(multi, xfer);
+    }
+    return -1;
+}
+
+int gfc_multi_add(gfcmulti_t *multi, gfcrequest_t **gfr,
+                  void (*donefunc)(gfcrequest_t **gfr, int result, void *donearg), void *donearg) {
+    gfc_transfer_t *xfer = malloc(sizeof(gfc_transfer_t));
+    xfer->req = *gfr;
+    xfer->donefunc = donefunc;
+    xfer->donearg = donearg;
+    xfer->sent = 0;
+    xfer->req->status = GF_INVALID;
+    xfer->req->fileLength = 0;
+    xfer->req->bytesReceived = 0;
+    gfc_conn_init(&xfer->conn, (*gfr)->server, (*gfr)->portno);
+    multi->in_flight++;
+
+    // Name resolution is synchronous; it is cached after gfc_global_init
+    gfc_check_plain(xfer->req, &xfer->conn);
+    int length = gfc_render_request(xfer->req, 0, xfer->conn.buffer, GFC_BUFFER_SIZE);
+    xfer->addr = (length == -1) ? NULL : gfc_resolve(&xfer->conn, &xfer->owned);
+    xfer->rp = xfer->addr;
+    xfer->request_length = length;
+    if (xfer->addr == NULL || gfc_xfer_connect(multi, xfer) == -1) {
+        gfc_xfer_done(multi, xfer, -1);
+        return -1;
+    }
+    return 0;
+}
+
+int gfc_multi_wait(gfcmulti_t *multi, size_t min_complete) {
+    size_t completed = 0;
+
+    while (multi->in_flight > 0) {
+        struct io_uring_cqe *cqe;
+        while ((cqe = gf_uring_peek_cqe(&multi->ring)) != NULL) {
+            gfc_transfer_t *xfer = (gfc_transfer_t *) (unsigned long) cqe->user_data;
+            int res = cqe->res;
+            gf_uring_cqe_seen(&multi->ring);
+
+            int rc = gfc_xfer_step(multi, xfer, res);
+            if (rc != 0) {
+                gfc_xfer_done(multi, xfer, rc == 1 ? 0 : -1);
+                completed++;
+            }
+        }
+        if (completed >= min_complete || multi->in_flight == 0) {
+            break;
+        }
+        if (gf_uring_submit(&multi->ring, 1) == -1 && errno != EBUSY) {
+            fprintf(stderr, "%s @ %d: io_uring_enter failed\n", __FILE__, __LINE__);
+            return -1;
+        }
+    }
+
+    // Leave nothing queued behind, so transfers progress between calls
+    if (multi->ring.sq_pending > 0 && gf_uring_submit(&multi->ring, 0) == -1) {
+        return -1;
+    }
+    return (int) completed;
+}
+
+void gfc_multi_cleanup(gfcmulti_t **multi) {
+    if (multi == NULL || *multi == NULL) return;
+    gf_uring_destroy(&(*multi)->ring);
+    free(*multi);
+    *multi = NULL;
+}
+
 void gfc_set_port(gfcrequest_t **gfr, unsigned short port) {
     (*gfr)->portno = port;
 }
@@ -275,6 +960,21 @@ void gfc_set_path(gfcrequest_t **gfr, const char *path) {
     (*gfr)->path = strdup(path);
 }
 
+void gfc_set_keepalive(gfcrequest_t **gfr, int keepalive) {
+    (*gfr)->keepalive = keepalive;
+}
+
+void gfc_set_range(gfcrequest_t **gfr, size_t offset, size_t length) {
+    (*gfr)->ranged = 1;
+    (*gfr)->rangeOffset = offset;
+    (*gfr)->rangeLength = length;
+}
+
+void gfc_set_ifversion(gfcrequest_t **gfr, const char *version) {
+    free((*gfr)->ifVersion);
+    (*gfr)->ifVersion = version ? strdup(version) : NULL;
+}
+
 void gfc_set_writefunc(gfcrequest_t **gfr, void (*writefunc)(void *, size_t, void *)) {
     (*gfr)->writefunc = writefunc;
 }
@@ -306,6 +1006,11 @@ const char *gfc_strstatus(gfstatus_t status) {
             strstatus = "ERROR";
         }
         break;
+
+        case GF_NOT_MODIFIED: {
+            strstatus = "NOT_MODIFIED";
+        }
+        break;
     }
 
     return strstatus;
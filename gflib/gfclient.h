@@ -13,12 +13,19 @@ typedef enum{
   GF_OK = 0,
   GF_FILE_NOT_FOUND = (GF_OK + 1),
   GF_ERROR = (GF_OK + 2),
-  GF_INVALID = (GF_OK + 3)
+  GF_INVALID = (GF_OK + 3),
+  GF_NOT_MODIFIED = (GF_OK + 4)
 } gfstatus_t;
 
 /*struct for a getfile request*/
 typedef struct gfcrequest_t gfcrequest_t;
 
+/*struct for a persistent connection to a getfile server*/
+typedef struct gfcconn_t gfcconn_t;
+
+/*struct driving many requests at once from a single thread*/
+typedef struct gfcmulti_t gfcmulti_t;
+
 /*
  * Returns the string associated with the input status
  */
@@ -48,6 +55,23 @@ void gfc_set_port(gfcrequest_t **gfr, unsigned short port);
  */
 void gfc_set_path(gfcrequest_t **gfr, const char* path);
 
+/*
+ * Asks for length bytes of the file starting at offset instead of the
+ * whole file.  The server clamps the range to the file, so a length of 0
+ * only fetches the file's size.  gfc_get_filelen then returns the length
+ * of the range received, and gfc_get_totallen the length of the file.
+ */
+void gfc_set_range(gfcrequest_t **gfr, size_t offset, size_t length);
+
+/*
+ * Makes the request conditional on the file no longer being at version,
+ * as returned by gfc_get_version for an earlier download of it.  If it
+ * still is, the server answers GF_NOT_MODIFIED without a body.  The server
+ * only reports versions to requests that set one; an empty version asks
+ * for it without making the request conditional.
+ */
+void gfc_set_ifversion(gfcrequest_t **gfr, const char *version);
+
 /*
  * Sets the callback for received header.  The registered callback
  * will receive a pointer the header of the response, the length  
@@ -93,9 +117,91 @@ void gfc_set_writefunc(gfcrequest_t **gfr, void (*writefunc)(void *data_buffer,
  * communication is not successful (e.g. the connection is closed before
  * transfer is complete or an invalid header is returned), then a negative
  * integer will be returned.
+ *
+ * Ranges, versions and keep-alive are asked for with tokens after the path
+ * ("RANGE", "IFVERSION", "KEEPALIVE").  Servers that predate them take the
+ * tokens for part of the path and answer FILE_NOT_FOUND.  Such an answer,
+ * without a KEEPALIVE echo, is retried once as a plain request.  If the
+ * retry finds the file, the server is remembered as plain-only until
+ * gfc_global_cleanup, and later requests to it leave the tokens out.  The
+ * caller then gets the whole file, with no version, even for a range or
+ * conditional request.  Without gfc_global_init nothing is remembered, so
+ * each such request takes the extra round trip.
  */
 int gfc_perform(gfcrequest_t **gfr);
 
+/*
+ * Creates a persistent connection to the given server.  The connection is
+ * opened lazily by the first request that uses it, and is reopened as
+ * needed if the server closes it.
+ */
+gfcconn_t *gfc_conn_create(const char *server, unsigned short port);
+
+/*
+ * Closes the connection and frees memory associated with it.
+ */
+void gfc_conn_close(gfcconn_t **conn);
+
+/*
+ * Makes gfc_perform send the request over the given persistent connection,
+ * asking the server to keep it open for later requests.  Servers that do
+ * not support keep-alive simply close it, and the next request reconnects.
+ * The connection is not owned by the request and must outlive it.
+ */
+void gfc_set_conn(gfcrequest_t **gfr, gfcconn_t *conn);
+
+/*
+ * Makes gfc_perform ask the server to keep the connection open, without
+ * tying the request to a connection of its own.  Between gfc_global_init
+ * and gfc_global_cleanup, such requests share a pool of open connections.
+ * Requests sent without it carry no KEEPALIVE token.
+ */
+void gfc_set_keepalive(gfcrequest_t **gfr, int keepalive);
+
+/*
+ * Performs n requests over the given persistent connection, writing all of
+ * them back to back before reading the responses in order.  The server and
+ * port set on the requests are ignored in favor of the connection's.
+ * Returns 0 if every response was received, otherwise a negative integer.
+ */
+int gfc_perform_pipeline(gfcrequest_t **gfrs, size_t n, gfcconn_t *conn);
+
+/*
+ * Creates a handle that runs many requests concurrently from the calling
+ * thread, each over its own connection, with io_uring doing the socket
+ * I/O.  queue_depth sizes the submission ring; more requests than that may
+ * still be in flight.  Returns NULL if io_uring is not available.
+ */
+gfcmulti_t *gfc_multi_create(unsigned int queue_depth);
+
+/*
+ * Starts the request on the multi handle and returns right away; the
+ * transfer only makes progress inside gfc_multi_wait.  Once it is over,
+ * donefunc is called with the request, the value gfc_perform would have
+ * returned and donearg.  The request belongs to the multi handle until
+ * then, and donefunc may clean it up or add new requests.  Returns -1 if
+ * the request could not be started, in which case donefunc has already
+ * been called.
+ */
+int gfc_multi_add(gfcmulti_t *multi, gfcrequest_t **gfr,
+                  void (*donefunc)(gfcrequest_t **gfr, int result, void *donearg), void *donearg);
+
+/*
+ * Drives the transfers until at least min_complete of them are over, or
+ * none is left.  Returns the number completed, or -1 on failure.
+ */
+int gfc_multi_wait(gfcmulti_t *multi, size_t min_complete);
+
+/*
+ * Returns the number of requests added and not yet completed.
+ */
+size_t gfc_multi_pending(gfcmulti_t *multi);
+
+/*
+ * Frees the multi handle.  Wait for pending requests first.
+ */
+void gfc_multi_cleanup(gfcmulti_t **multi);
+
 /*
  * Returns the status of the response.
  */
@@ -114,6 +220,24 @@ size_t gfc_get_filelen(gfcrequest_t **gfr);
  */
 size_t gfc_get_bytesreceived(gfcrequest_t **gfr);
 
+/*
+ * Returns the length of the whole file as indicated by the response
+ * header, which differs from gfc_get_filelen for a range request.
+ */
+size_t gfc_get_totallen(gfcrequest_t **gfr);
+
+/*
+ * Returns the offset in the file of the range the server sent, 0 unless
+ * the request asked for one with gfc_set_range.
+ */
+size_t gfc_get_rangeoffset(gfcrequest_t **gfr);
+
+/*
+ * Returns the version of the file sent with an OK response, or an empty
+ * string if the server did not send one.
+ */
+const char *gfc_get_version(gfcrequest_t **gfr);
+
 /*
  * Frees memory associated with the request.
  */
@@ -121,7 +245,11 @@ void gfc_cleanup(gfcrequest_t **gfr);
 
 
 /*
- * Sets up any global data structures needed for the library.
+ * Sets up any global data structures needed for the library.  Until
+ * gfc_global_cleanup, addresses are resolved once per server, and requests
+ * set up with gfc_set_keepalive borrow connections from a shared pool,
+ * returning them afterwards if the server left them open.  Other requests
+ * go out exactly as without it.
  * Warning: this function may not be thread-safe.
  */
 void gfc_global_init();
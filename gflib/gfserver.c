@@ -1,4 +1,12 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include "gfserver-student.h"
 
@@ -11,23 +19,108 @@ struct gfserver_t {
     void* arg;
     int max_npending;
     int listen_fd;
+    gfs_engine_t engine;
+
+    // Sharded mode: nshards copies of this server, each accepting on its
+    // own SO_REUSEPORT listener in its own thread, pinned to CPU cpu
+    // (the first of the shard's share of the CPUs)
+    int nshards;
+    int pin_cpus;
+    void **shard_args;
+    int reuseport;
+    int cpu;
+
+    // Keep-alive connections whose response is done wait here until the
+    // reactor picks them up again; wake_fd tells it the list is non-empty.
+    int wake_fd;
+    pthread_mutex_t ready_lock;
+    gfcontext_t *ready;
 };
 
+#define GFS_HEADER_MAX 1024
+#define GFS_VERSION_MAX 64
+#define GFS_MAX_EVENTS 256
+#define GFS_URING_ENTRIES 256
+
+// io_uring user_data tags; anything else is the gfcontext_t being read into
+#define GFS_URING_ACCEPT 1
+#define GFS_URING_WAKE 2
+
+// The request header lives in the context so the path handed to the
+// handler stays valid for as long as the handler owns the connection.  The
+// parser tracks what is buffered there; with pipelining that may run past
+// the header of the request currently being served.
 struct gfcontext_t {
     int conn_fd;
+    gfserver_t *gfs;
+    gfcontext_t *next;
+    int registered;
+    int nonblocking;  // switched by gfs_nonblocking for gfs_sendfile_some
+    int keepalive;
+    int response_done;
+    size_t body_remaining;
+    size_t body_total;
+    int ranged;
+    size_t range_offset;
+    size_t range_length;
+    size_t range_start;
+    size_t range_end;
+    int wants_version;
+    char *if_version;
+    char version[GFS_VERSION_MAX];
+    gf_header_parser_t parser;
+    char header[GFS_HEADER_MAX];
 };
 
+// Contexts are created by acceptors and freed by whichever thread finishes
+// the response, so they come from a pool instead of malloc
+static gf_pool_t gfs_context_pool;
+
+// Body accounting, so gfs_finish knows whether the connection can be reused
+static void gfs_account_body(gfcontext_t *ctx, size_t sent) {
+    ctx->body_remaining -= (sent < ctx->body_remaining) ? sent : ctx->body_remaining;
+    if (ctx->body_remaining == 0) {
+        ctx->response_done = 1;
+    }
+}
+
+// Handlers always send the whole file; for a range request only the part
+// inside [range_start, range_end) goes out.  Given the next len body bytes
+// the handler sends, stores in skip how many of them to drop first and
+// returns how many to send after that.  The skipped bytes still count as
+// sent towards the handler.
+static size_t gfs_range_clip(gfcontext_t *ctx, size_t len, size_t *skip) {
+    *skip = 0;
+    if (!ctx->ranged) {
+        return len;
+    }
+
+    size_t pos = ctx->body_total - ctx->body_remaining;
+    size_t start = pos > ctx->range_start ? pos : ctx->range_start;
+    size_t end = pos + len < ctx->range_end ? pos + len : ctx->range_end;
+    if (end <= start) {
+        *skip = len;
+        return 0;
+    }
+    *skip = start - pos;
+    return end - start;
+}
+
 void gfs_cleanup(gfserver_t *gfs) {
     if (gfs->listen_fd != -1) {
         close(gfs->listen_fd);
     }
+    if (gfs->wake_fd != -1) {
+        close(gfs->wake_fd);
+    }
+    pthread_mutex_destroy(&gfs->ready_lock);
     free(gfs);
 }
 
 void gfs_abort(gfcontext_t **ctx){
     if (ctx && *ctx) {
         close((*ctx)->conn_fd);
-        free(*ctx);
+        gf_pool_put(&gfs_context_pool, *ctx);
         *ctx = NULL;
     }
 }
@@ -38,62 +131,298 @@ ssize_t gfs_send(gfcontext_t **ctx, const void *data, size_t len){
     }
 
     // fprintf(stdout, "Sending %lu data from %p\n", len, data);
+    size_t skip;
+    size_t wanted = gfs_range_clip(*ctx, len, &skip);
     ssize_t sent = 0;
-    while (sent < len) {
-        ssize_t currSent = send((*ctx)->conn_fd, data+sent, len - sent, 0);
+    while (sent < wanted) {
+        ssize_t currSent = send((*ctx)->conn_fd, data+skip+sent, wanted - sent, 0);
         if (currSent == -1) {
             fprintf(stderr, "%s @ %d: file send failed\n", __FILE__, __LINE__);
             return -1;
         }
         sent += currSent;
     }
+    gfs_account_body(*ctx, len);
+    return len;
+}
+
+ssize_t gfs_sendfile(gfcontext_t **ctx, int fd, off_t offset, size_t len){
+    if (!ctx || !*ctx) {
+        return -1;  // Connection was aborted
+    }
+
+    // sendfile advances the local offset copy only, so fd stays shareable
+    size_t skip;
+    size_t wanted = gfs_range_clip(*ctx, len, &skip);
+    size_t sent = 0;
+    offset += skip;
+    while (sent < wanted) {
+        ssize_t currSent = sendfile((*ctx)->conn_fd, fd, &offset, wanted - sent);
+        if (currSent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s @ %d: sendfile failed\n", __FILE__, __LINE__);
+            return -1;
+        }
+        if (currSent == 0) {
+            break;  // File is shorter than len
+        }
+        sent += currSent;
+    }
+    sent = (sent == wanted) ? len : skip + sent;
+    gfs_account_body(*ctx, sent);
     return sent;
 }
 
-ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len){
+static int gfs_set_nonblocking(int fd, int nonblocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+int gfs_nonblocking(gfcontext_t **ctx){
     if (!ctx || !*ctx) {
         return -1;  // Connection was aborted
     }
+    if (!(*ctx)->nonblocking) {
+        if (gfs_set_nonblocking((*ctx)->conn_fd, 1) == -1) {
+            return -1;
+        }
+        (*ctx)->nonblocking = 1;
+    }
+    return 0;
+}
 
-    char buffer[1024];
-    ssize_t header_length = 0;
+ssize_t gfs_sendfile_some(gfcontext_t **ctx, int fd, off_t offset, size_t len){
+    if (!ctx || !*ctx) {
+        return -1;  // Connection was aborted
+    }
+
+    size_t skip;
+    size_t wanted = gfs_range_clip(*ctx, len, &skip);
+    if (wanted == 0) {
+        gfs_account_body(*ctx, len);
+        return len;
+    }
+    offset += skip;
+
+    // A full socket buffer ends the call early, as a short write
+    ssize_t sent = 0;
+    while (sent < wanted) {
+        ssize_t currSent = sendfile((*ctx)->conn_fd, fd, &offset, wanted - sent);
+        if (currSent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "%s @ %d: sendfile failed\n", __FILE__, __LINE__);
+                sent = -1;
+            }
+            break;
+        }
+        if (currSent == 0) {
+            fprintf(stderr, "%s @ %d: file shorter than announced\n", __FILE__, __LINE__);
+            sent = -1;
+            break;
+        }
+        sent += currSent;
+    }
+
+    if (sent > 0) {
+        sent = (sent == wanted) ? len : skip + sent;
+        gfs_account_body(*ctx, sent);
+    }
+    return sent;
+}
+
+void gfs_set_version(gfcontext_t **ctx, const char *version){
+    if (!ctx || !*ctx) {
+        return;
+    }
+    if (version == NULL || strlen(version) >= GFS_VERSION_MAX || strchr(version, ' ') != NULL) {
+        (*ctx)->version[0] = '\0';
+        return;
+    }
+    strcpy((*ctx)->version, version);
+}
+
+int gfs_fd(gfcontext_t **ctx){
+    return (ctx && *ctx) ? (*ctx)->conn_fd : -1;
+}
+
+// Renders the response header into buffer and sets up body accounting for
+// the response it starts.  Returns the header length.  A range response
+// carries the length of the range, followed by " RANGE <offset> <total>",
+// the range actually served and the length of the whole file.  With a
+// version set and a client that asked for versions, " VERSION <version>"
+// comes next, or the whole response is "GETFILE NOT_MODIFIED" if the client
+// already has that version.  Clients that did not ask never see either.
+static int gfs_render_header(gfcontext_t *ctx, gfstatus_t status, size_t file_len, char *buffer) {
+    // The KEEPALIVE token tells the client the connection stays open
+    const char *keepalive = ctx->keepalive ? " KEEPALIVE" : "";
+    int header_length = 0;
     switch (status) {
         case GF_OK:
-            header_length = sprintf(buffer, "GETFILE OK %lu\r\n\r\n", file_len);
+            if (ctx->version[0] != '\0' && ctx->if_version && strcmp(ctx->if_version, ctx->version) == 0) {
+                // The body still has to be accounted for; an empty range
+                // drops all of it
+                header_length = sprintf(buffer, "GETFILE NOT_MODIFIED%s\r\n\r\n", keepalive);
+                ctx->ranged = 1;
+                ctx->range_start = ctx->range_end = 0;
+                break;
+            }
+            header_length = sprintf(buffer, "GETFILE OK %lu", file_len);
+            if (ctx->ranged) {
+                // Clamp the requested range to the file
+                size_t max_length = file_len - (ctx->range_offset < file_len ? ctx->range_offset : file_len);
+                ctx->range_start = file_len - max_length;
+                ctx->range_end = ctx->range_start + (ctx->range_length < max_length ? ctx->range_length : max_length);
+                header_length = sprintf(buffer, "GETFILE OK %lu RANGE %lu %lu",
+                                        ctx->range_end - ctx->range_start, ctx->range_start, file_len);
+            }
+            if (ctx->version[0] != '\0' && ctx->wants_version) {
+                header_length += sprintf(buffer + header_length, " VERSION %s", ctx->version);
+            }
+            header_length += sprintf(buffer + header_length, "%s\r\n\r\n", keepalive);
             break;
         case GF_ERROR:
-            header_length = sprintf(buffer, "GETFILE ERROR\r\n\r\n");
+            header_length = sprintf(buffer, "GETFILE ERROR%s\r\n\r\n", keepalive);
             break;
         case GF_INVALID:
-            header_length = sprintf(buffer, "GETFILE INVALID\r\n\r\n");
+            header_length = sprintf(buffer, "GETFILE INVALID%s\r\n\r\n", keepalive);
             break;
         case GF_FILE_NOT_FOUND:
-            header_length = sprintf(buffer, "GETFILE FILE_NOT_FOUND\r\n\r\n");
+            header_length = sprintf(buffer, "GETFILE FILE_NOT_FOUND%s\r\n\r\n", keepalive);
             break;
     }
+    ctx->body_remaining = (status == GF_OK) ? file_len : 0;
+    ctx->body_total = ctx->body_remaining;
+    ctx->response_done = (ctx->body_remaining == 0);
+    return header_length;
+}
 
-    // fprintf(stdout, "Sending header: %s", buffer);
+// Sends the whole header, passing flags (e.g. MSG_MORE) to every send.
+static ssize_t gfs_send_header_bytes(gfcontext_t *ctx, const char *buffer, ssize_t header_length, int flags) {
     ssize_t sent = 0;
     while (sent < header_length) {
-        ssize_t sd = send((*ctx)->conn_fd, buffer+sent, header_length - sent, 0);
+        ssize_t sd = send(ctx->conn_fd, buffer+sent, header_length - sent, flags);
         if (sd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             fprintf(stderr, "%s @ %d: header send failed\n", __FILE__, __LINE__);
             return -1;
         }
         sent += sd;
     }
-
-    // fprintf(stdout, "Sent header: %s\n", buffer);
     return header_length;
 }
 
+ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len){
+    if (!ctx || !*ctx) {
+        return -1;  // Connection was aborted
+    }
+
+    char buffer[1024];
+    int header_length = gfs_render_header(*ctx, status, file_len, buffer);
+
+    // fprintf(stdout, "Sending header: %s", buffer);
+    return gfs_send_header_bytes(*ctx, buffer, header_length, 0);
+}
+
+ssize_t gfs_sendresponse(gfcontext_t **ctx, const void *data, size_t len){
+    if (!ctx || !*ctx) {
+        return -1;  // Connection was aborted
+    }
+
+    char buffer[1024];
+    struct iovec iov[2];
+    size_t skip;
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = gfs_render_header(*ctx, GF_OK, len, buffer);
+    iov[1].iov_len = gfs_range_clip(*ctx, len, &skip);
+    iov[1].iov_base = (char *) data + skip;
+
+    // Header and body leave in one writev unless the socket buffer fills up
+    struct iovec *pending = iov;
+    int npending = 2;
+    size_t body_sent = 0;
+    while (npending > 0) {
+        ssize_t sd = writev((*ctx)->conn_fd, pending, npending);
+        if (sd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s @ %d: response send failed\n", __FILE__, __LINE__);
+            gfs_account_body(*ctx, body_sent);
+            return -1;
+        }
+        while (npending > 0 && (size_t) sd >= pending->iov_len) {
+            sd -= pending->iov_len;
+            if (pending == &iov[1]) {
+                body_sent += pending->iov_len;
+            }
+            pending++;
+            npending--;
+        }
+        if (npending > 0) {
+            pending->iov_base = (char *) pending->iov_base + sd;
+            pending->iov_len -= sd;
+            if (pending == &iov[1]) {
+                body_sent += sd;
+            }
+        }
+    }
+    gfs_account_body(*ctx, len);
+    return len;
+}
+
+ssize_t gfs_sendresponse_file(gfcontext_t **ctx, int fd, off_t offset, size_t len){
+    if (!ctx || !*ctx) {
+        return -1;  // Connection was aborted
+    }
+
+    // MSG_MORE holds the header back so it shares a segment with the body
+    char buffer[1024];
+    int header_length = gfs_render_header(*ctx, GF_OK, len, buffer);
+    size_t skip;
+    int more = gfs_range_clip(*ctx, len, &skip) > 0 ? MSG_MORE : 0;
+    if (gfs_send_header_bytes(*ctx, buffer, header_length, more) == -1) {
+        return -1;
+    }
+    return gfs_sendfile(ctx, fd, offset, len);
+}
+
+static void gfs_context_pool_init(void) {
+    if (gf_pool_init(&gfs_context_pool, sizeof(gfcontext_t)) != 0) {
+        fprintf(stderr, "%s @ %d: context pool init failed\n", __FILE__, __LINE__);
+        exit(EXIT_FAILURE);
+    }
+}
+
 gfserver_t* gfserver_create(){
+    static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+    pthread_once(&pool_once, gfs_context_pool_init);
+
     gfserver_t *gfs = malloc(sizeof(gfserver_t));
 
     gfs->handler = NULL;
     gfs->arg = NULL;
     gfs->max_npending = 0;
     gfs->listen_fd = -1;
+    gfs->engine = GFS_ENGINE_BLOCKING;
+    gfs->nshards = 1;
+    gfs->pin_cpus = 0;
+    gfs->shard_args = NULL;
+    gfs->reuseport = 0;
+    gfs->cpu = -1;
+    gfs->wake_fd = -1;
+    pthread_mutex_init(&gfs->ready_lock, NULL);
+    gfs->ready = NULL;
 
     return gfs;
 }
@@ -128,6 +457,13 @@ int gfserver_setup_socket(gfserver_t **gfs) {
         freeaddrinfo(addr);
         return -1;
     }
+    if ((*gfs)->reuseport &&
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        fprintf(stderr, "%s @ %d: setsockopt(SO_REUSEPORT)\n", __FILE__, __LINE__);
+        close(listen_fd);
+        freeaddrinfo(addr);
+        return -1;
+    }
 
     int bd = bind(listen_fd, addr->ai_addr, addr->ai_addrlen);
 
@@ -139,7 +475,9 @@ int gfserver_setup_socket(gfserver_t **gfs) {
         return -1;
     }
 
-    int ln = listen(listen_fd, 5);
+    // A backlog too short for a burst of connects makes the kernel drop
+    // the handshakes it cannot queue, and clients only retry after a second
+    int ln = listen(listen_fd, (*gfs)->max_npending > 0 ? (*gfs)->max_npending : SOMAXCONN);
     if (ln == -1) {
         fprintf(stderr, "%s @ %d: listen failed\n", __FILE__, __LINE__);
         close(listen_fd);
@@ -150,100 +488,594 @@ int gfserver_setup_socket(gfserver_t **gfs) {
     return 0;
 }
 
-void gfserver_serve(gfserver_t **gfs) {
-    if (gfserver_setup_socket(gfs) == -1) {
-        gfs_cleanup(*gfs);
+// Returns NULL, with the connection closed, if no context can be had
+static gfcontext_t *gfs_context_create(gfserver_t *gfs, int conn_fd) {
+    gfcontext_t *ctx = gf_pool_get(&gfs_context_pool);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s @ %d: out of memory for a connection\n", __FILE__, __LINE__);
+        close(conn_fd);
+        return NULL;
+    }
+    ctx->conn_fd = conn_fd;
+    ctx->gfs = gfs;
+    ctx->next = NULL;
+    ctx->registered = 0;
+    ctx->nonblocking = 0;
+    ctx->keepalive = 0;
+    ctx->response_done = 0;
+    ctx->body_remaining = 0;
+    ctx->body_total = 0;
+    ctx->ranged = 0;
+    ctx->wants_version = 0;
+    ctx->if_version = NULL;
+    ctx->version[0] = '\0';
+    gf_header_init(&ctx->parser, ctx->header, sizeof(ctx->header) - 1);
+    return ctx;
+}
+
+// Reads from the connection until the header delimiter arrives.
+// Returns 1 once the header is complete (or the peer stopped sending, or the
+// buffer is full, which the parser rejects), 0 if a non-blocking socket has
+// no more data yet, and -1 if the receive failed or the peer closed an idle
+// connection.
+static int gfs_read_header(gfcontext_t *ctx) {
+    // A pipelined request may already be sitting in the buffer
+    gf_header_status_t status = gf_header_feed(&ctx->parser, 0);
+
+    while (status == GF_HEADER_NEED_MORE) {
+        size_t room;
+        char *space = gf_header_space(&ctx->parser, &room);
+        ssize_t received = recv(ctx->conn_fd, space, room, 0);
+        if (received == 0) {
+            return (ctx->parser.length == 0) ? -1 : 1;
+        }
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s @ %d: receive failed\n", __FILE__, __LINE__);
+            return -1;
+        }
+        status = gf_header_feed(&ctx->parser, received);
+    }
+    return 1;
+}
+
+// Strips a trailing " IFVERSION <version>" from the path, if there is one,
+// and records the version the client has.  The token also asks for the
+// version in the response; "-" asks for it without naming one.
+static void gfs_parse_if_version(gfcontext_t *ctx, char *path) {
+    char *token = strrchr(path, ' ');
+    if (token == NULL || token - path < 10 || !gf_token_equal(token - 10, " IFVERSION", 10) || token[1] == '\0') {
+        return;
+    }
+    token[-10] = '\0';
+    ctx->wants_version = 1;
+    ctx->if_version = strcmp(token + 1, "-") == 0 ? NULL : token + 1;
+}
+
+// Strips a trailing " RANGE <offset> <length>" from the path, if there is
+// one, and records the requested range.
+static void gfs_parse_range(gfcontext_t *ctx, char *path) {
+    char *token = NULL;
+    for (char *p = strstr(path, " RANGE "); p != NULL; p = strstr(p + 1, " RANGE ")) {
+        token = p;
+    }
+    if (token == NULL) {
+        return;
+    }
+
+    const char *numbers = token + 7;
+    ssize_t end = strlen(numbers);
+    ssize_t i = 0;
+    size_t offset, length;
+    if (gf_parse_number(numbers, &i, end, &offset) == -1 || i++ == end ||
+        gf_parse_number(numbers, &i, end, &length) == -1 || i != end) {
+        return;
+    }
+    *token = '\0';
+    ctx->ranged = 1;
+    ctx->range_offset = offset;
+    ctx->range_length = length;
+}
+
+// Validates the received header in place and returns the requested path,
+// or NULL if the request is malformed.  A trailing " KEEPALIVE" token asks
+// for the connection to stay open; it is only granted by the reactor
+// engines (epoll and io_uring), which are able to wait for the next request.
+// Before it, " IFVERSION <version>" makes the request conditional and
+// " RANGE <offset> <length>" asks for part of the file only.
+static char *gfs_parse_request(gfcontext_t *ctx) {
+    char *header = ctx->header;
+    ssize_t header_length = ctx->parser.header_length;
+
+    // No delimiter found before the peer stopped or the buffer filled up
+    if (header_length == 0) {
+        return NULL;
+    }
+    // Check the length, it should at least have 16 chars
+    if (header_length < 16) {
+        return NULL;
+    }
+    // 0 to 11: GETFILE GET
+    if (!gf_token_equal(header, "GETFILE GET ", 12)) {
+        return NULL;
+    }
+    // Check that path starts with '/'
+    if (header[12] != '/') {
+        return NULL;
+    }
+    // 12 to header_length-5: path
+    header[header_length - 4] = '\0';  // Replace first '\r' with null terminator
+
+    size_t path_length = header_length - 16;
+    if (path_length > 10 && gf_token_equal(header + header_length - 14, " KEEPALIVE", 10)) {
+        header[header_length - 14] = '\0';
+        ctx->keepalive = (ctx->gfs->engine != GFS_ENGINE_BLOCKING);
+    }
+    gfs_parse_if_version(ctx, header + 12);
+    gfs_parse_range(ctx, header + 12);
+    return header + 12;
+}
+
+// Hands a connection with a complete header to the registered handler.  If
+// the handler returns without taking ownership of the context, the response
+// is finished and the connection is closed here.
+static void gfs_dispatch(gfserver_t *gfs, gfcontext_t *ctx) {
+    char *path = gfs_parse_request(ctx);
+    if (path == NULL) {
+        fprintf(stderr, "%s @ %d: received wrong header\n", __FILE__, __LINE__);
+        gfs_sendheader(&ctx, GF_INVALID, 0);
+        gfs_abort(&ctx);
+        return;
+    }
+
+    // Pass the path to handler
+    gfs->handler(&ctx, path, gfs->arg);
+    gfs_finish(&ctx);
+}
+
+void gfs_finish(gfcontext_t **ctx) {
+    if (!ctx || !*ctx) {
+        return;
+    }
+    gfcontext_t *c = *ctx;
+    if (!c->keepalive || !c->response_done) {
+        gfs_abort(ctx);
         return;
     }
+    // The engines expect a blocking socket back
+    if (c->nonblocking) {
+        if (gfs_set_nonblocking(c->conn_fd, 0) == -1) {
+            gfs_abort(ctx);
+            return;
+        }
+        c->nonblocking = 0;
+    }
+    *ctx = NULL;
+
+    // Drop the served request, keeping any pipelined bytes behind it
+    gf_header_consume(&c->parser, c->parser.header_length);
+    c->keepalive = 0;
+    c->response_done = 0;
+    c->body_remaining = 0;
+    c->body_total = 0;
+    c->ranged = 0;
+    c->wants_version = 0;
+    c->if_version = NULL;
+    c->version[0] = '\0';
+
+    // Hand the connection back to the reactor thread
+    gfserver_t *gfs = c->gfs;
+    pthread_mutex_lock(&gfs->ready_lock);
+    c->next = gfs->ready;
+    gfs->ready = c;
+    pthread_mutex_unlock(&gfs->ready_lock);
+
+    uint64_t one = 1;
+    if (write(gfs->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "%s @ %d: wake write failed\n", __FILE__, __LINE__);
+    }
+}
+
+static void gfserver_serve_blocking(gfserver_t *gfs) {
     // Start infinite loop to accept new connection
-    char header[1024];
     while (1) {
-        int conn_fd = accept((*gfs)->listen_fd, NULL, NULL);
+        int conn_fd = accept4(gfs->listen_fd, NULL, NULL, SOCK_CLOEXEC);
         if (conn_fd == -1) {
             fprintf(stderr, "%s @ %d: accept failed\n", __FILE__, __LINE__);
             continue;
         }
 
         // New connection accepted, initialize the context info
-        gfcontext_t *ctx = malloc(sizeof(gfcontext_t));
-        ctx->conn_fd = conn_fd;
-        // fprintf(stdout, "Connected with %d\n", conn_fd);
-
-        // receive the header
-        ssize_t header_length = 0;
-        int header_found = 0;
-        while (!header_found) {
-            ssize_t received = recv(ctx->conn_fd, header + header_length, sizeof(header) - header_length - 1, 0);
-            if (received == 0) {
-                break;
-            }
-            if (received == -1) {
-                fprintf(stderr, "%s @ %d: receive failed\n", __FILE__, __LINE__);
-                close(ctx->conn_fd);
-                free(ctx);
-                break;
+        gfcontext_t *ctx = gfs_context_create(gfs, conn_fd);
+        if (ctx == NULL) {
+            continue;
+        }
+        if (gfs_read_header(ctx) == -1) {
+            gfs_abort(&ctx);
+            continue;
+        }
+        gfs_dispatch(gfs, ctx);
+    }
+}
+
+// Moves a connection with a non-blocking socket forward: dispatches its
+// request once fully buffered, otherwise makes sure epoll watches it for
+// edge-triggered read readiness.  The context doubles as the epoll cookie.
+static void gfs_advance(gfserver_t *gfs, int epoll_fd, gfcontext_t *ctx) {
+    int rd = gfs_read_header(ctx);
+    if (rd == 0) {
+        if (!ctx->registered) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = ctx;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ctx->conn_fd, &ev) == -1) {
+                fprintf(stderr, "%s @ %d: epoll_ctl failed\n", __FILE__, __LINE__);
+                gfs_abort(&ctx);
+                return;
             }
-            header_length += received;
+            ctx->registered = 1;
+        }
+        return;  // partial header, wait for the next edge
+    }
 
-            // Look for header end delimiter starting from a safe position
-            ssize_t start = (header_length >= 4) ? header_length - received - 3 : 0;
-            if (start < 0) start = 0;
+    if (ctx->registered) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ctx->conn_fd, NULL);
+        ctx->registered = 0;
+    }
+    if (rd == -1 || gfs_set_nonblocking(ctx->conn_fd, 0) == -1) {
+        gfs_abort(&ctx);
+        return;
+    }
+    gfs_dispatch(gfs, ctx);
+}
 
-            for (ssize_t i = start; i <= header_length - 4; i++) {
-                if (header[i] == '\r' && header[i+1] == '\n' &&
-                    header[i+2] == '\r' && header[i+3] == '\n') {
-                    header_found = 1;
-                    break;
-                }
+// Accepts every pending connection and starts reading its request.
+static void gfs_accept_all(gfserver_t *gfs, int epoll_fd) {
+    while (1) {
+        int conn_fd = accept4(gfs->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "%s @ %d: accept failed\n", __FILE__, __LINE__);
             }
+            return;
         }
-        // fprintf(stdout, "Received Header: %s\n", header);
 
-        // Header received complete, parse the header
-        // Check the length, it should at least have 16 chars
-        if (header_length < 16) {
-            fprintf(stderr, "%s @ %d: received wrong header\n", __FILE__, __LINE__);
-            gfs_sendheader(&ctx, GF_INVALID, 0);
-            close(ctx->conn_fd);
-            free(ctx);
-            continue;
+        gfcontext_t *ctx = gfs_context_create(gfs, conn_fd);
+        if (ctx != NULL) {
+            gfs_advance(gfs, epoll_fd, ctx);
         }
-        // 0 to 11: GETFILE GET
-        if (memcmp(header, "GETFILE GET ", 12) != 0) {
-            fprintf(stderr, "%s @ %d: received wrong header\n", __FILE__, __LINE__);
-            gfs_sendheader(&ctx, GF_INVALID, 0);
-            close(ctx->conn_fd);
-            free(ctx);
+    }
+}
+
+// Picks up keep-alive connections handed back by gfs_finish and goes on
+// with their next (possibly already pipelined) request.
+static void gfs_resume_ready(gfserver_t *gfs, int epoll_fd) {
+    uint64_t count;
+    if (read(gfs->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "%s @ %d: wake read failed\n", __FILE__, __LINE__);
+    }
+
+    pthread_mutex_lock(&gfs->ready_lock);
+    gfcontext_t *ready = gfs->ready;
+    gfs->ready = NULL;
+    pthread_mutex_unlock(&gfs->ready_lock);
+
+    while (ready != NULL) {
+        gfcontext_t *ctx = ready;
+        ready = ctx->next;
+        ctx->next = NULL;
+        if (gfs_set_nonblocking(ctx->conn_fd, 1) == -1) {
+            gfs_abort(&ctx);
             continue;
         }
+        gfs_advance(gfs, epoll_fd, ctx);
+    }
+}
 
-        // Check that path starts with '/'
-        if (header[12] != '/') {
-            fprintf(stderr, "%s @ %d: path must start with /\n", __FILE__, __LINE__);
-            gfs_sendheader(&ctx, GF_INVALID, 0);
-            close(ctx->conn_fd);
-            free(ctx);
-            continue;
+// Reactor loop: headers are read from all connections concurrently, and a
+// connection only reaches the handler once its request is fully received.
+// The socket is switched back to blocking mode first, so handlers keep the
+// same gfs_send semantics as in the blocking engine.
+static void gfserver_serve_epoll(gfserver_t *gfs) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        fprintf(stderr, "%s @ %d: epoll_create1 failed\n", __FILE__, __LINE__);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;  // NULL marks the listening socket
+    if (gfs_set_nonblocking(gfs->listen_fd, 1) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, gfs->listen_fd, &ev) == -1) {
+        fprintf(stderr, "%s @ %d: unable to register listening socket\n", __FILE__, __LINE__);
+        close(epoll_fd);
+        return;
+    }
+
+    gfs->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = gfs;  // the server itself marks the wake-up eventfd
+    if (gfs->wake_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, gfs->wake_fd, &ev) == -1) {
+        fprintf(stderr, "%s @ %d: unable to register wake-up eventfd\n", __FILE__, __LINE__);
+        close(epoll_fd);
+        return;
+    }
+
+    struct epoll_event events[GFS_MAX_EVENTS];
+    while (1) {
+        int nready = epoll_wait(epoll_fd, events, GFS_MAX_EVENTS, -1);
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s @ %d: epoll_wait failed\n", __FILE__, __LINE__);
+            break;
         }
 
-        // header_length-4 to header_length-1: \r\n\r\n
-        if (header[header_length-1] != '\n' ||
-            header[header_length-2] != '\r' ||
-            header[header_length-3] != '\n' ||
-            header[header_length-4] != '\r')
-        {
-            fprintf(stderr, "%s @ %d: received wrong header\n", __FILE__, __LINE__);
-            gfs_sendheader(&ctx, GF_INVALID, 0);
-            close(ctx->conn_fd);
-            free(ctx);
-            continue;
+        for (int i = 0; i < nready; i++) {
+            void *cookie = events[i].data.ptr;
+            if (cookie == NULL) {
+                gfs_accept_all(gfs, epoll_fd);
+            } else if (cookie == gfs) {
+                gfs_resume_ready(gfs, epoll_fd);
+            } else {
+                gfs_advance(gfs, epoll_fd, cookie);
+            }
         }
-        // 12 to header_length-5: path
-        header[header_length - 4] = '\0';  // Replace first '\r' with null terminator
+    }
+    close(epoll_fd);
+}
 
-        // Pass the path to handler
-        (*gfs)->handler(&ctx, header + 12, (*gfs)->arg);
+// Queues a receive for the rest of a request header, or dispatches the
+// request right away when a full one (or a full buffer) is already there.
+static void gfs_uring_advance(gfserver_t *gfs, gf_uring_t *ring, gfcontext_t *ctx) {
+    if (gf_header_feed(&ctx->parser, 0) != GF_HEADER_NEED_MORE) {
+        gfs_dispatch(gfs, ctx);
+        return;
     }
+
+    struct io_uring_sqe *sqe = gf_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "%s @ %d: submission queue full\n", __FILE__, __LINE__);
+        gfs_abort(&ctx);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ctx->conn_fd;
+    size_t room;
+    sqe->addr = (unsigned long) gf_header_space(&ctx->parser, &room);
+    sqe->len = room;
+    sqe->user_data = (unsigned long) ctx;
+}
+
+// Handles a completed header receive, mirroring gfs_read_header.
+static void gfs_uring_received(gfserver_t *gfs, gf_uring_t *ring, gfcontext_t *ctx, int res) {
+    if (res == -EINTR || res == -EAGAIN) {
+        gfs_uring_advance(gfs, ring, ctx);
+        return;
+    }
+    if (res < 0) {
+        fprintf(stderr, "%s @ %d: receive failed\n", __FILE__, __LINE__);
+        gfs_abort(&ctx);
+        return;
+    }
+    if (res == 0) {
+        // The peer stopped sending: close idle connections, let the parser
+        // reject a truncated header
+        if (ctx->parser.length == 0) {
+            gfs_abort(&ctx);
+        } else {
+            gfs_dispatch(gfs, ctx);
+        }
+        return;
+    }
+
+    if (gf_header_feed(&ctx->parser, res) != GF_HEADER_NEED_MORE) {
+        gfs_dispatch(gfs, ctx);
+        return;
+    }
+    gfs_uring_advance(gfs, ring, ctx);
+}
+
+static int gfs_uring_arm(gf_uring_t *ring, int opcode, int fd, void *buffer, unsigned len, unsigned long tag) {
+    struct io_uring_sqe *sqe = gf_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = len;
+    sqe->user_data = tag;
+    return 0;
+}
+
+// A multishot accept keeps posting one completion per connection until it
+// runs into an error, so a burst is drained without re-arming in between.
+static int gfs_uring_arm_accept(gf_uring_t *ring, int listen_fd, int multishot) {
+    struct io_uring_sqe *sqe = gf_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->user_data = GFS_URING_ACCEPT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    return 0;
+}
+
+// Completion-based intake: accepts, header receives and keep-alive
+// wake-ups are all queued on one io_uring and submitted in a single system
+// call per loop iteration.  The response path does not use the ring:
+// sockets stay in blocking mode, and handlers send with the same gfs_send
+// calls as with the other engines.
+static void gfserver_serve_uring_accept(gfserver_t *gfs) {
+    gf_uring_t ring;
+    if (gf_uring_init(&ring, GFS_URING_ENTRIES) == -1) {
+        fprintf(stderr, "%s @ %d: io_uring_setup failed\n", __FILE__, __LINE__);
+        return;
+    }
+
+    // Read from the eventfd through the ring, which waits for it to be
+    // written rather than failing with EAGAIN
+    uint64_t wake_count;
+    int multishot = 1;
+    gfs->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (gfs->wake_fd == -1 ||
+        gfs_uring_arm_accept(&ring, gfs->listen_fd, multishot) == -1 ||
+        gfs_uring_arm(&ring, IORING_OP_READ, gfs->wake_fd, &wake_count, sizeof(wake_count), GFS_URING_WAKE) == -1) {
+        fprintf(stderr, "%s @ %d: unable to arm the listening socket\n", __FILE__, __LINE__);
+        gf_uring_destroy(&ring);
+        return;
+    }
+
+    while (1) {
+        if (gf_uring_submit(&ring, 1) == -1 && errno != EBUSY) {
+            fprintf(stderr, "%s @ %d: io_uring_enter failed\n", __FILE__, __LINE__);
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = gf_uring_peek_cqe(&ring)) != NULL) {
+            unsigned long tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            gf_uring_cqe_seen(&ring);
+
+            if (tag == GFS_URING_ACCEPT) {
+                if (res >= 0) {
+                    gfcontext_t *ctx = gfs_context_create(gfs, res);
+                    if (ctx != NULL) {
+                        gfs_uring_advance(gfs, &ring, ctx);
+                    }
+                } else if (res == -EINVAL && multishot) {
+                    multishot = 0;  // kernel older than 5.19, accept one at a time
+                } else if (res != -EINTR && res != -ECONNABORTED) {
+                    fprintf(stderr, "%s @ %d: accept failed\n", __FILE__, __LINE__);
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    gfs_uring_arm_accept(&ring, gfs->listen_fd, multishot);
+                }
+            } else if (tag == GFS_URING_WAKE) {
+                pthread_mutex_lock(&gfs->ready_lock);
+                gfcontext_t *ready = gfs->ready;
+                gfs->ready = NULL;
+                pthread_mutex_unlock(&gfs->ready_lock);
+
+                while (ready != NULL) {
+                    gfcontext_t *ctx = ready;
+                    ready = ctx->next;
+                    ctx->next = NULL;
+                    gfs_uring_advance(gfs, &ring, ctx);
+                }
+                gfs_uring_arm(&ring, IORING_OP_READ, gfs->wake_fd, &wake_count, sizeof(wake_count), GFS_URING_WAKE);
+            } else {
+                gfs_uring_received(gfs, &ring, (gfcontext_t *) tag, res);
+            }
+        }
+    }
+    gf_uring_destroy(&ring);
+}
+
+static void gfs_serve_engine(gfserver_t *gfs) {
+    switch (gfs->engine) {
+        case GFS_ENGINE_EPOLL:
+            gfserver_serve_epoll(gfs);
+            break;
+        case GFS_ENGINE_URING_ACCEPT:
+            gfserver_serve_uring_accept(gfs);
+            break;
+        case GFS_ENGINE_BLOCKING:
+        default:
+            gfserver_serve_blocking(gfs);
+            break;
+    }
+}
+
+static void *gfs_shard_main(void *arg) {
+    gfserver_t *shard = arg;
+    if (shard->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "%s @ %d: unable to pin acceptor to cpu %d\n", __FILE__, __LINE__, shard->cpu);
+        }
+    }
+    gfs_serve_engine(shard);
+    return NULL;
+}
+
+// Runs one acceptor thread per shard.  Every shard binds its own listener
+// to the port with SO_REUSEPORT, so the kernel spreads incoming connections
+// across them, and keep-alive connections stay with the shard that
+// accepted them.
+static void gfserver_serve_sharded(gfserver_t *gfs) {
+    int nshards = gfs->nshards;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    gfserver_t **shards = malloc(sizeof(gfserver_t *) * nshards);
+    pthread_t *tids = malloc(sizeof(pthread_t) * nshards);
+    int started = 0;
+
+    for (int i = 0; i < nshards; i++) {
+        gfserver_t *shard = gfserver_create();
+        shard->port = gfs->port;
+        shard->handler = gfs->handler;
+        shard->arg = gfs->shard_args ? gfs->shard_args[i] : gfs->arg;
+        shard->max_npending = gfs->max_npending;
+        shard->engine = gfs->engine;
+        shard->reuseport = 1;
+        shard->cpu = -1;
+        if (gfs->pin_cpus && ncpus > 0) {
+            // First CPU of the shard's share [i*ncpus/nshards, (i+1)*ncpus/nshards),
+            // or CPU i modulo ncpus when there are more shards than CPUs
+            shard->cpu = (int) (nshards <= ncpus ? i * ncpus / nshards : i % ncpus);
+        }
+        shards[i] = shard;
+
+        if (gfserver_setup_socket(&shards[i]) == -1) {
+            gfs_cleanup(shard);
+            break;
+        }
+        if (pthread_create(&tids[started], NULL, gfs_shard_main, shard) != 0) {
+            fprintf(stderr, "%s @ %d: unable to start acceptor %d\n", __FILE__, __LINE__, i);
+            gfs_cleanup(shard);
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        gfs_cleanup(shards[i]);
+    }
+    free(tids);
+    free(shards);
+}
+
+void gfserver_serve(gfserver_t **gfs) {
+    if ((*gfs)->nshards > 1) {
+        gfserver_serve_sharded(*gfs);
+        return;
+    }
+
+    if (gfserver_setup_socket(gfs) == -1) {
+        gfs_cleanup(*gfs);
+        return;
+    }
+    gfs_serve_engine(*gfs);
 }
 
 void gfserver_set_handler(gfserver_t **gfs, gfh_error_t (*handler)(gfcontext_t **, const char *, void*)) {
@@ -252,4 +1084,17 @@ void gfserver_set_handler(gfserver_t **gfs, gfh_error_t (*handler)(gfcontext_t *
 
 void gfserver_set_maxpending(gfserver_t **gfs, int max_npending) {
     (*gfs)->max_npending = max_npending;
-}
\ No newline at end of file
+}
+
+void gfserver_set_engine(gfserver_t **gfs, gfs_engine_t engine) {
+    (*gfs)->engine = engine;
+}
+
+void gfserver_set_shards(gfserver_t **gfs, int nshards, int pin_cpus) {
+    (*gfs)->nshards = (nshards > 1) ? nshards : 1;
+    (*gfs)->pin_cpus = pin_cpus;
+}
+
+void gfserver_set_shard_handlerargs(gfserver_t **gfs, void **args) {
+    (*gfs)->shard_args = args;
+}
@@ -6,6 +6,14 @@
 /*
  * gfserver is a server library for transferring files using the GETFILE
  * protocol.
+ *
+ * A request is "GETFILE GET <path>", optionally followed by the tokens
+ * " RANGE <offset> <length>", " IFVERSION <version>" and " KEEPALIVE" in
+ * that order, and ended by "\r\n\r\n".  The server answers a token only
+ * if it understands it.  Servers that predate the tokens read them as part
+ * of the path and answer FILE_NOT_FOUND, so clients cannot tell such a
+ * server from a missing file.  gfclient retries that case once without
+ * tokens (see gfc_perform).
  */
 
 typedef int gfstatus_t;
@@ -16,6 +24,25 @@ typedef int gfstatus_t;
 #define  GF_INVALID 600
 
 typedef size_t gfh_error_t;
+
+/*
+ * Connection handling strategies for gfserver_serve.
+ * - GFS_ENGINE_BLOCKING accepts one connection at a time and reads its
+ *   request header before accepting the next one.
+ * - GFS_ENGINE_EPOLL accepts connections in bulk and reads request
+ *   headers from all of them concurrently with an edge-triggered epoll
+ *   loop, calling the handler only once a request is fully received.
+ * - GFS_ENGINE_URING_ACCEPT does the same with io_uring: accepts, header
+ *   reads and keep-alive wake-ups are queued on one ring and submitted in
+ *   batches.  Only those go through the ring; responses are still sent
+ *   with plain blocking calls on the handler's thread, as with the other
+ *   engines.  Needs Linux 5.6 or later.
+ */
+typedef enum {
+    GFS_ENGINE_BLOCKING = 0,
+    GFS_ENGINE_EPOLL = 1,
+    GFS_ENGINE_URING_ACCEPT = 2,
+} gfs_engine_t;
 typedef struct gfcontext_t gfcontext_t;
 typedef struct gfserver_t gfserver_t;
 
@@ -59,10 +86,40 @@ void gfserver_set_maxpending(gfserver_t **gfs, int max_npending);
  */
 void gfserver_set_handlerarg(gfserver_t **gfs, void* arg);
 
+/*
+ * Selects how gfserver_serve accepts connections and reads requests.
+ * Defaults to GFS_ENGINE_BLOCKING.  Must be called before gfserver_serve.
+ */
+void gfserver_set_engine(gfserver_t **gfs, gfs_engine_t engine);
+
+/*
+ * Makes gfserver_serve run nshards acceptor threads, each with its own
+ * SO_REUSEPORT listener on the port and its own engine loop, so the kernel
+ * spreads new connections across them.  With pin_cpus, the online CPUs
+ * are split into nshards disjoint ranges [i*ncpus/nshards,
+ * (i+1)*ncpus/nshards) and acceptor i is pinned to the first CPU of its
+ * range (to CPU i modulo ncpus when there are more shards than CPUs), so
+ * the handler can pin the shard's workers to the same range.  Defaults to
+ * a single acceptor.  Must be called before gfserver_serve.
+ */
+void gfserver_set_shards(gfserver_t **gfs, int nshards, int pin_cpus);
+
+/*
+ * Gives each shard its own third argument for the handler callback:
+ * requests accepted by shard i are handled with args[i] in place of the
+ * gfserver_set_handlerarg pointer.  args must hold one entry per shard and
+ * stay valid while the server runs.
+ */
+void gfserver_set_shard_handlerargs(gfserver_t **gfs, void **args);
+
 /*
  * Sends to the client the Getfile header containing the appropriate
  * status and file length for the given inputs.  This function should
  * only be called from within a callback registered gfserver_set_handler.
+ *
+ * When the request asked for a byte range, file_len is still the length of
+ * the whole file and the handler still sends all of it: the header and the
+ * gfs_send* functions restrict the response to the range on their own.
  */
 ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len);
 
@@ -74,6 +131,65 @@ ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len);
  */
 ssize_t gfs_send(gfcontext_t **ctx, const void *data, size_t size);
 
+/*
+ * Sends len bytes of the open file fd, starting at offset, to the client
+ * without copying them through user space.  The file offset of fd is not
+ * changed, so the same descriptor can be shared between handlers.  This
+ * function should only be called from within a callback registered with
+ * gfserver_set_handler.  It returns the number of bytes sent, which is
+ * less than len only if the file is shorter than expected, or -1 on error.
+ */
+ssize_t gfs_sendfile(gfcontext_t **ctx, int fd, off_t offset, size_t len);
+
+/*
+ * Switches the connection to non-blocking sends, once, before the first
+ * gfs_sendfile_some call.  After it, only gfs_sendfile_some may send on the
+ * connection.  It returns 0, or -1 on error.
+ */
+int gfs_nonblocking(gfcontext_t **ctx);
+
+/*
+ * Like gfs_sendfile, but only sends as much as the connection takes without
+ * waiting, once gfs_nonblocking was called.  It returns the number of bytes
+ * sent, 0 if the socket buffer is full, or -1 on error.  Wait for gfs_fd to
+ * become writable before trying again, so one handler thread can drive many
+ * slow transfers.
+ */
+ssize_t gfs_sendfile_some(gfcontext_t **ctx, int fd, off_t offset, size_t len);
+
+/*
+ * Sets the version of the file being served, a validator such as its size
+ * and modification time that changes whenever its content does.  Call it
+ * before sending the header.  If the request carried an IFVERSION token,
+ * the OK header then carries the version, and if the client sent the same
+ * one, the header is turned into a NOT_MODIFIED answer and the body is
+ * dropped as it is sent.  Other clients get a plain header.
+ * Versions longer than 63 bytes or holding spaces are ignored.
+ */
+void gfs_set_version(gfcontext_t **ctx, const char *version);
+
+/*
+ * Returns the connection's socket, to poll for writability between
+ * gfs_sendfile_some calls.  It must not be read from, written to or closed.
+ */
+int gfs_fd(gfcontext_t **ctx);
+
+/*
+ * Sends a complete GF_OK response: the Getfile header for a file of len
+ * bytes followed by the len bytes starting at data, written together so
+ * that small files leave in a single segment.  Use it in place of a
+ * gfs_sendheader + gfs_send pair.  It returns the number of body bytes
+ * sent, or -1 on error.
+ */
+ssize_t gfs_sendresponse(gfcontext_t **ctx, const void *data, size_t len);
+
+/*
+ * Like gfs_sendresponse, with the body taken from len bytes of the open
+ * file fd starting at offset, as with gfs_sendfile.  The header is corked
+ * so that it shares a segment with the start of the body.
+ */
+ssize_t gfs_sendresponse_file(gfcontext_t **ctx, int fd, off_t offset, size_t len);
+
 /*
  * this routine is used to handle the getfile request
  */
@@ -85,4 +201,14 @@ gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void* arg);
  */
 void gfs_abort(gfcontext_t **ctx);
 
+/*
+ * Releases the gfcontext_t once the handler has sent the complete
+ * response.  If the client asked for a persistent connection, it is handed
+ * back to the server to wait for the next request; otherwise (or if the
+ * response was cut short) the connection is closed as with gfs_abort.
+ * Handlers that return without taking ownership of the context do not need
+ * to call it, the server finishes the response for them.
+ */
+void gfs_finish(gfcontext_t **ctx);
+
 #endif
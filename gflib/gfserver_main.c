@@ -20,6 +20,8 @@
   "options:\n"                                                                                 \
   "  -m [content_file]  Content file mapping keys to content filea (Default: 'content.txt')\n" \
   "  -p [listen_port]   Listen port (Default: 39485)\n"                                        \
+  "  -e [engine]        Connection engine: blocking, epoll or uring-accept (Default: blocking)\n" \
+  "  -b [backlog]       Pending connections queued by the kernel (Default: 1024)\n"        \
   "  -h          		Show this help message.\n"              		                       \
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -27,6 +29,8 @@ static struct option gLongOptions[] = {
     {"content", required_argument, NULL, 'm'},
     {"help", no_argument, NULL, 'h'},
     {"port", required_argument, NULL, 'p'},
+    {"engine", required_argument, NULL, 'e'},
+    {"backlog", required_argument, NULL, 'b'},
     {NULL, 0, NULL, 0}};
 
 /* Main ========================================================= */
@@ -34,13 +38,15 @@ int main(int argc, char **argv) {
   int option_char = 0;
   char *content_map_file = "content.txt";
   unsigned short port = 39485;
+  gfs_engine_t engine = GFS_ENGINE_BLOCKING;
+  int backlog = 1024;
   gfserver_t *gfs = NULL;
 
 
   setbuf(stdout, NULL);  // disable caching of standpard output
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "hal:p:m:", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "hal:p:m:e:b:", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 'm':  /* file-path */
         content_map_file = optarg;
@@ -48,6 +54,21 @@ int main(int argc, char **argv) {
       case 'p':  /* listen-port */
         port = atoi(optarg);
         break;
+      case 'b':  /* backlog */
+        backlog = atoi(optarg);
+        break;
+      case 'e':  /* engine */
+        if (strcmp(optarg, "epoll") == 0) {
+          engine = GFS_ENGINE_EPOLL;
+        } else if (strcmp(optarg, "uring-accept") == 0 || strcmp(optarg, "uring") == 0) {
+          engine = GFS_ENGINE_URING_ACCEPT;
+        } else if (strcmp(optarg, "blocking") == 0) {
+          engine = GFS_ENGINE_BLOCKING;
+        } else {
+          fprintf(stderr, "Unknown engine %s\n", optarg);
+          exit(1);
+        }
+        break;
       case 'h':  /* help */
         fprintf(stdout, "%s", USAGE);
         exit(0);
@@ -71,7 +92,8 @@ int main(int argc, char **argv) {
   /*Setting options*/
   gfserver_set_handler(&gfs, gfs_handler);
   gfserver_set_port(&gfs, port);
-  gfserver_set_maxpending(&gfs, 25);
+  gfserver_set_maxpending(&gfs, backlog);
+  gfserver_set_engine(&gfs, engine);
 
   /* this implementation does not pass any extra state, so it uses NULL. */
   /* this value could be non-NULL.  You might want to test that in your own */
@@ -0,0 +1,211 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cache.h"
+
+/*
+ * Entries are found through a chained hash table and kept on a circular
+ * list swept by a CLOCK hand: a hit sets the referenced bit, and eviction
+ * clears bits until it reaches an entry that was not used since the last
+ * sweep.  An evicted entry leaves the table right away but its data is only
+ * freed once the last worker sending it releases it.  Entries remember the
+ * version of the file they were read from, and a lookup for another
+ * version misses.
+ */
+
+#define CACHE_NBUCKETS 1024
+
+typedef struct item_t {
+	cache_entry_t entry;	/* must stay first */
+	char *key;
+	char *version;
+	uint32_t hash;
+	int refs;
+	int referenced;
+	int cached;
+	struct item_t *chain;
+	struct item_t *prev;
+	struct item_t *next;
+} item_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static item_t *buckets[CACHE_NBUCKETS];
+static item_t *hand;
+static size_t used;
+static size_t budget;
+static size_t max_size;
+
+static uint32_t _hash(const char *key){
+	uint32_t h = 2166136261u;
+	for (; *key; key++) {
+		h ^= (unsigned char) *key;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static item_t *_find(const char *key, uint32_t hash){
+	item_t *item;
+	for (item = buckets[hash % CACHE_NBUCKETS]; item != NULL; item = item->chain) {
+		if (item->hash == hash && strcmp(item->key, key) == 0)
+			return item;
+	}
+	return NULL;
+}
+
+static void _free(item_t *item){
+	free((void*) item->entry.data);
+	free(item->key);
+	free(item->version);
+	free(item);
+}
+
+/* Takes an item out of the table and the clock; caller holds the lock */
+static void _unlink(item_t *item){
+	item_t **link = &buckets[item->hash % CACHE_NBUCKETS];
+	while (*link != item)
+		link = &(*link)->chain;
+	*link = item->chain;
+
+	if (item->next == item) {
+		hand = NULL;
+	} else {
+		item->prev->next = item->next;
+		item->next->prev = item->prev;
+		if (hand == item)
+			hand = item->next;
+	}
+	used -= item->entry.len;
+	item->cached = 0;
+}
+
+/* Evicts until len more bytes fit; caller holds the lock */
+static void _make_room(size_t len){
+	while (hand != NULL && used + len > budget) {
+		item_t *victim = hand;
+		if (victim->referenced) {
+			victim->referenced = 0;
+			hand = victim->next;
+			continue;
+		}
+		_unlink(victim);
+		if (victim->refs == 0)
+			_free(victim);
+	}
+}
+
+void cache_init(size_t budget_bytes, size_t max_size_bytes){
+	budget = budget_bytes;
+	max_size = max_size_bytes;
+	used = 0;
+	hand = NULL;
+	memset(buckets, 0, sizeof(buckets));
+}
+
+cache_entry_t *cache_acquire(const char *key, const char *version){
+	if (budget == 0)
+		return NULL;
+
+	uint32_t hash = _hash(key);
+	pthread_mutex_lock(&cache_lock);
+	item_t *item = _find(key, hash);
+	if (item != NULL && strcmp(item->version, version) != 0)
+		item = NULL;
+	if (item != NULL) {
+		item->refs++;
+		item->referenced = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return item ? &item->entry : NULL;
+}
+
+cache_entry_t *cache_load(const char *key, const char *version, int fd, size_t size){
+	if (budget == 0 || size > max_size || size > budget)
+		return NULL;
+
+	/* Read outside the lock; concurrent misses may each load a copy */
+	char *data = malloc(size ? size : 1);
+	size_t offset = 0;
+	while (offset < size) {
+		ssize_t bytes_read = pread(fd, data + offset, size - offset, offset);
+		if (bytes_read <= 0) {
+			free(data);
+			return NULL;
+		}
+		offset += bytes_read;
+	}
+
+	item_t *item = malloc(sizeof(item_t));
+	item->entry.data = data;
+	item->entry.len = size;
+	item->key = strdup(key);
+	item->version = strdup(version);
+	item->hash = _hash(key);
+	item->refs = 1;
+	item->referenced = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	item_t *existing = _find(key, item->hash);
+	if (existing != NULL && strcmp(existing->version, version) != 0) {
+		/* The file changed since it was cached */
+		_unlink(existing);
+		if (existing->refs == 0)
+			_free(existing);
+		existing = NULL;
+	}
+	if (existing != NULL) {
+		/* Lost the race to another loader, use its copy */
+		existing->refs++;
+		existing->referenced = 1;
+		pthread_mutex_unlock(&cache_lock);
+		_free(item);
+		return &existing->entry;
+	}
+
+	_make_room(size);
+	item->cached = 1;
+	item->chain = buckets[item->hash % CACHE_NBUCKETS];
+	buckets[item->hash % CACHE_NBUCKETS] = item;
+	if (hand == NULL) {
+		item->prev = item->next = item;
+		hand = item;
+	} else {
+		/* Insert just behind the hand, the last place it will look */
+		item->next = hand;
+		item->prev = hand->prev;
+		hand->prev->next = item;
+		hand->prev = item;
+	}
+	used += size;
+	pthread_mutex_unlock(&cache_lock);
+
+	return &item->entry;
+}
+
+void cache_release(cache_entry_t *entry){
+	item_t *item = (item_t*) entry;
+	int unused;
+
+	pthread_mutex_lock(&cache_lock);
+	unused = (--item->refs == 0 && !item->cached);
+	pthread_mutex_unlock(&cache_lock);
+
+	if (unused)
+		_free(item);
+}
+
+void cache_destroy(){
+	pthread_mutex_lock(&cache_lock);
+	while (hand != NULL) {
+		item_t *item = hand;
+		_unlink(item);
+		_free(item);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,50 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+
+/*
+ * In-memory copy of a file held by the cache.  Entries stay valid while
+ * acquired, even if they are evicted in the meantime.
+ */
+typedef struct cache_entry_t cache_entry_t;
+
+struct cache_entry_t {
+	const char *data;
+	size_t len;
+};
+
+/*
+ * Initializes the cache to hold at most budget bytes of file data, only
+ * admitting files of at most max_size bytes.  A budget of 0 disables the
+ * cache, making every lookup miss.
+ */
+void cache_init(size_t budget, size_t max_size);
+
+/*
+ * Returns the cached copy of the given version of the file associated
+ * with key and marks it recently used, or NULL if it is not cached.  The
+ * entry must be handed back with cache_release.
+ */
+cache_entry_t *cache_acquire(const char *key, const char *version);
+
+/*
+ * Reads size bytes of the open file fd into the cache under key, evicting
+ * entries that have not been used recently to stay within the budget.  A
+ * cached copy of another version of the file is dropped.  Returns the new
+ * entry acquired as with cache_acquire, or NULL if the file is not
+ * admitted or cannot be read.
+ */
+cache_entry_t *cache_load(const char *key, const char *version, int fd, size_t size);
+
+/*
+ * Releases an entry obtained from cache_acquire or cache_load.
+ */
+void cache_release(cache_entry_t *entry);
+
+/*
+ * Frees all cached data.  No entries may still be acquired.
+ */
+void cache_destroy();
+
+#endif
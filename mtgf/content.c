@@ -1,97 +1,486 @@
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
-#define MAX_KEYLEN 512
+#include "content.h"
+
+/*
+ * Keys are interned back to back in a single string arena and looked up
+ * through an open-addressing table with linear probing.  The table only
+ * stores a 32-bit hash and an entry index per slot, so a probe sequence
+ * walks a dense array and a full key compare happens only when the hashes
+ * already match.  Each file's version, taken from its size and
+ * modification time when it is opened, is interned in the same arena.
+ * With mapping enabled, each file is also mapped read-only for its whole
+ * size so handlers can send it without any file syscalls.
+ *
+ * Everything loaded from one read of the content map forms a table.  A
+ * reload builds a new table off to the side and publishes it with a single
+ * pointer store.  Each acquired file holds a reference on its table, but
+ * while a table is current its references are counted in per-thread slots,
+ * each on its own cache line, so lookups never write to memory shared with
+ * other threads.  Threads mark the few instructions of taking or dropping
+ * a reference by making their own sequence number odd.  A reload marks the
+ * old table retired, publishes the new one, then waits for a grace period:
+ * until every thread that was inside such a section has left it.  After
+ * that nobody can take a reference on the old table any more, and drops
+ * on it go to a single shared count, to which the reload adds the sum of
+ * the slots.  Whoever brings that count to zero frees the whole table.
+ */
+
+#define CONTENT_SLOTS 64
+
+typedef struct content_table_t content_table_t;
+
+/* One per thread that ever looked up content, never freed before content_destroy */
+typedef struct reader_t{
+	unsigned long seq;   /* odd while taking or dropping a reference */
+	int slot;
+	struct reader_t *next;
+} reader_t;
 
 typedef struct{
-	int fildes;
-	char key[MAX_KEYLEN];
+	long refs;   /* taken minus dropped by the threads using the slot, may be negative */
+	char pad[64 - sizeof(long)];
+} ref_slot_t;
+
+typedef struct{
+	content_file_t file;	/* must stay first */
+	content_table_t *table;
+	uint32_t key_off;
+	uint32_t key_len;
+	uint32_t version_off;
 } item_t;
 
-static int nitems;
-static item_t *items;
+struct content_table_t{
+	int retired;
+	long refs;            /* references still held once retired, see content_reload */
+	ref_slot_t *slots;    /* CONTENT_SLOTS counts while current */
+	int nitems;
+	item_t *items;
+
+	char *arena;
+	size_t arena_len;
+	size_t arena_cap;
+
+	uint32_t *slot_hash;   /* 0 marks an empty slot */
+	uint32_t *slot_item;
+	uint32_t slot_mask;
+
+	content_table_t *older;   /* next retired table not yet drained */
+};
+
+static int map_flags;
+static char *map_filename;
+
+static content_table_t *current;
+static content_table_t *retired;   /* under reload_lock */
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static reader_t *readers;
+static int nreaders;
+static __thread reader_t *self;
+
+static uint32_t _hash(const char *key, size_t len){
+	/* FNV-1a, folded to 32 bits */
+	uint64_t h = 1469598103934665603ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) key[i];
+		h *= 1099511628211ULL;
+	}
+	uint32_t folded = (uint32_t) (h ^ (h >> 32));
+	return folded ? folded : 1;
+}
 
-static int _itemcmp(const void *a, const void *b){
-	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
+static int _lookup(content_table_t *table, const char *key, size_t len, uint32_t hash){
+	uint32_t slot = hash & table->slot_mask;
+
+	while (table->slot_hash[slot] != 0) {
+		if (table->slot_hash[slot] == hash) {
+			item_t *item = &table->items[table->slot_item[slot]];
+			if (item->key_len == len && memcmp(table->arena + item->key_off, key, len) == 0)
+				return table->slot_item[slot];
+		}
+		slot = (slot + 1) & table->slot_mask;
+	}
+	return -1;
 }
 
-int content_init(const char *filename){
+static void _index_build(content_table_t *table){
+	uint32_t nslots = 16;
+	while (nslots < 2 * (uint32_t) table->nitems)
+		nslots <<= 1;
+
+	table->slot_hash = calloc(nslots, sizeof(uint32_t));
+	table->slot_item = malloc(nslots * sizeof(uint32_t));
+	table->slot_mask = nslots - 1;
+
+	for (int i = 0; i < table->nitems; i++) {
+		item_t *item = &table->items[i];
+		const char *key = table->arena + item->key_off;
+		uint32_t hash = _hash(key, item->key_len);
+
+		/* The arena no longer moves, so versions can point into it */
+		item->file.version = table->arena + item->version_off;
+
+		/* Duplicate keys keep their first mapping */
+		if (_lookup(table, key, item->key_len, hash) != -1)
+			continue;
+
+		uint32_t slot = hash & table->slot_mask;
+		while (table->slot_hash[slot] != 0)
+			slot = (slot + 1) & table->slot_mask;
+		table->slot_hash[slot] = hash;
+		table->slot_item[slot] = i;
+	}
+}
+
+static uint32_t _intern(content_table_t *table, const char *key, size_t len){
+	if (table->arena_len + len + 1 > table->arena_cap) {
+		while (table->arena_len + len + 1 > table->arena_cap)
+			table->arena_cap *= 2;
+		table->arena = realloc(table->arena, table->arena_cap);
+	}
+	uint32_t off = table->arena_len;
+	memcpy(table->arena + off, key, len);
+	table->arena[off + len] = '\0';
+	table->arena_len += len + 1;
+	return off;
+}
+
+static int _map(content_file_t *file, const char *path){
+	static const char empty[1];
+
+	/* mmap refuses empty mappings, and there is nothing to send anyway */
+	if (file->size == 0) {
+		file->data = empty;
+		return 0;
+	}
+
+	int mmap_flags = MAP_PRIVATE;
+	if (map_flags & CONTENT_MAP_POPULATE)
+		mmap_flags |= MAP_POPULATE;
+
+	void *data = mmap(NULL, file->size, PROT_READ, mmap_flags, file->fildes, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Unable to map file %s.\n", path);
+		return -1;
+	}
+	if (map_flags & CONTENT_MAP_POPULATE) {
+		/* Advice only, file-backed huge pages depend on the filesystem */
+#ifdef MADV_HUGEPAGE
+		madvise(data, file->size, MADV_HUGEPAGE);
+#endif
+		madvise(data, file->size, MADV_WILLNEED);
+	}
+	file->data = data;
+	return 0;
+}
+
+/* Closes and unmaps the files of a table and frees its index, keeping the header */
+static void _table_clear(content_table_t *table){
+	for (int i = 0; i < table->nitems; i++) {
+		content_file_t *file = &table->items[i].file;
+		if (file->data != NULL && file->size > 0)
+			munmap((void *) file->data, file->size);
+		close(file->fildes);
+	}
+
+	free(table->items);
+	free(table->arena);
+	free(table->slot_hash);
+	free(table->slot_item);
+	table->items = NULL;
+	table->arena = NULL;
+	table->slot_hash = NULL;
+	table->slot_item = NULL;
+	table->nitems = 0;
+}
+
+static void _table_free(content_table_t *table){
+	_table_clear(table);
+	free(table->slots);
+	free(table);
+}
+
+/* Unlinks a drained table from the retired list and frees it */
+static void _table_drained(content_table_t *table){
+	pthread_mutex_lock(&reload_lock);
+	content_table_t **link = &retired;
+	while (*link != table)
+		link = &(*link)->older;
+	*link = table->older;
+	pthread_mutex_unlock(&reload_lock);
+
+	_table_free(table);
+}
+
+/* Registers the calling thread on its first lookup */
+static reader_t *_reader(){
+	if (self == NULL) {
+		reader_t *reader = calloc(1, sizeof(reader_t));
+		reader->slot = __atomic_fetch_add(&nreaders, 1, __ATOMIC_RELAXED) % CONTENT_SLOTS;
+		reader->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&readers, &reader->next, reader, 1,
+		                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		self = reader;
+	}
+	return self;
+}
+
+/*
+ * Only the owner writes its sequence number.  Entering is sequentially
+ * consistent with the loads that follow it, pairing with the stores of
+ * content_reload before it reads the sequence numbers.
+ */
+static void _reader_enter(reader_t *reader){
+	__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_SEQ_CST);
+}
+
+static void _reader_exit(reader_t *reader){
+	__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Waits until every reader that is taking or dropping a reference is done */
+static void _grace_period(){
+	reader_t *reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+	for (; reader != NULL; reader = reader->next) {
+		unsigned long seq = __atomic_load_n(&reader->seq, __ATOMIC_SEQ_CST);
+		if (seq & 1)
+			while (__atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE) == seq)
+				sched_yield();
+	}
+}
+
+/* Takes a reference on the current table, which may be replaced meanwhile */
+static content_table_t *_table_get(){
+	reader_t *reader = _reader();
+
+	_reader_enter(reader);
+	content_table_t *table = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&table->slots[reader->slot].refs, 1, __ATOMIC_RELAXED);
+	_reader_exit(reader);
+	return table;
+}
+
+static void _table_put(content_table_t *table){
+	reader_t *reader = _reader();
+	int drained = 0;
+
+	_reader_enter(reader);
+	if (!__atomic_load_n(&table->retired, __ATOMIC_SEQ_CST))
+		__atomic_sub_fetch(&table->slots[reader->slot].refs, 1, __ATOMIC_RELAXED);
+	else
+		drained = __atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) == 0;
+	_reader_exit(reader);
+
+	if (drained)
+		_table_drained(table);
+}
+
+/* Reads the content map into a new table, or returns NULL if it cannot */
+static content_table_t *_table_load(const char *filename){
 	FILE *filelist;
 	int capacity = 16;
-	char *path, *ptr;
+	char *line = NULL, *key, *path, *ptr;
+	size_t line_cap = 0;
+	content_table_t *table;
 
 	if( NULL == (filelist = fopen(filename, "r"))){
 		fprintf(stderr, "Unable to open file in content_init.\n");
+		return NULL;
+	}
+
+	table = calloc(1, sizeof(content_table_t));
+	if (posix_memalign((void **) &table->slots, 64, CONTENT_SLOTS * sizeof(ref_slot_t)) != 0) {
+		fprintf(stderr, "Unable to allocate reference counts.\n");
 		exit(EXIT_FAILURE);
 	}
+	memset(table->slots, 0, CONTENT_SLOTS * sizeof(ref_slot_t));
+	table->items = (item_t*) malloc(capacity * sizeof(item_t));
+	table->arena_cap = 4096;
+	table->arena = malloc(table->arena_cap);
 
-	items = (item_t*) malloc(capacity * sizeof(item_t));
-	nitems = 0;
-	while(fgets(items[nitems].key, MAX_KEYLEN, filelist)){
-		size_t len = strlen(items[nitems].key);
-		while (len > 0 && (items[nitems].key[len-1] == '\n' || items[nitems].key[len-1] == '\r')){
-			items[nitems].key[--len] = '\0';
+	while(getline(&line, &line_cap, filelist) != -1){
+		size_t len = strlen(line);
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')){
+			line[--len] = '\0';
 		}
 		if (len == 0) continue;
 
 		/* Using space delimiter to sep key and path*/
-		ptr = items[nitems].key;
-		strsep(&ptr, " \t"); 		/* The key is first */
+		ptr = line;
+		key = strsep(&ptr, " \t"); 	/* The key is first */
 		path = strsep(&ptr, " \t"); /* The path second */
 
-		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
-			fprintf(stderr, "Unable to open file %s.\n", path);
-			exit(EXIT_FAILURE);
+		item_t *item = &table->items[table->nitems];
+		if( path == NULL || 0 > (item->file.fildes = open(path, O_RDONLY | O_CLOEXEC))){
+			fprintf(stderr, "Unable to open file %s.\n", path ? path : key);
+			goto fail;
 		}
-		nitems++;
 
-		if(nitems == capacity){
+		struct stat file_stat;
+		char version[64];
+		if (fstat(item->file.fildes, &file_stat) != 0) {
+			fprintf(stderr, "Unable to stat file %s.\n", path);
+			close(item->file.fildes);
+			goto fail;
+		}
+		item->file.size = file_stat.st_size;
+		item->file.data = NULL;
+		if ((map_flags & CONTENT_MAP) && _map(&item->file, path) != 0) {
+			close(item->file.fildes);
+			goto fail;
+		}
+
+		item->table = table;
+		item->key_len = strlen(key);
+		item->key_off = _intern(table, key, item->key_len);
+		int version_len = snprintf(version, sizeof(version), "%lx-%lx.%lx",
+		                           (unsigned long) file_stat.st_size,
+		                           (unsigned long) file_stat.st_mtim.tv_sec,
+		                           (unsigned long) file_stat.st_mtim.tv_nsec);
+		item->version_off = _intern(table, version, version_len);
+		table->nitems++;
+
+		if(table->nitems == capacity){
 			capacity *= 2;
-			items = realloc(items, capacity * sizeof(item_t));
+			table->items = realloc(table->items, capacity * sizeof(item_t));
 		}
 
 	}
 
+	free(line);
 	fclose(filelist);
 
-	qsort(items, nitems, sizeof(item_t), _itemcmp);
+	_index_build(table);
+
+	return table;
+
+fail:
+	free(line);
+	fclose(filelist);
+	_table_free(table);
+	return NULL;
+}
+
+void content_set_mapping(int flags){
+	map_flags = flags;
+}
+
+int content_init(const char *filename){
+	map_filename = strdup(filename);
+	if (NULL == (current = _table_load(filename)))
+		exit(EXIT_FAILURE);
 
 	return EXIT_SUCCESS;
 }
 
-unsigned long int content_delay = 0;
+int content_reload(){
+	content_table_t *table, *old;
 
-int content_get(const char *key){
-	int lo = 0;
-	int hi = nitems - 1;
-	int mid, cmp;
+	pthread_mutex_lock(&reload_lock);
+	if (NULL == (table = _table_load(map_filename))) {
+		pthread_mutex_unlock(&reload_lock);
+		return -1;
+	}
+
+	/*
+	 * Once the grace period is over, references on the old table are only
+	 * dropped through its shared count, and the slots hold what was still
+	 * taken at that point.  Drops racing ahead of the sum take the count
+	 * below zero, so only the last reference brings it back to zero.
+	 */
+	old = current;
+	__atomic_store_n(&old->retired, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&current, table, __ATOMIC_SEQ_CST);
+	_grace_period();
+
+	long refs = 0;
+	for (int i = 0; i < CONTENT_SLOTS; i++)
+		refs += __atomic_load_n(&old->slots[i].refs, __ATOMIC_RELAXED);
+	old->older = retired;
+	retired = old;
+	pthread_mutex_unlock(&reload_lock);
 
+	if (__atomic_add_fetch(&old->refs, refs, __ATOMIC_ACQ_REL) == 0)
+		_table_drained(old);
+	return 0;
+}
+
+unsigned long int content_delay = 0;
+
+void content_stall(){
 	if (content_delay > 0) {
 		usleep(content_delay);
 	}
+}
 
-	while (lo <= hi) {
-		// Key is in items[lo..hi] or not present.
-		mid = lo + (hi - lo) / 2;
-		cmp = strcmp(key,items[mid].key);
-		if ( cmp < 0) hi = mid - 1;
-		else if (cmp > 0) lo = mid + 1;
-		else{
-			return items[mid].fildes;
-		} 
+content_file_t *content_acquire(const char *key){
+	content_table_t *table = _table_get();
+	size_t len = strlen(key);
+	int i = _lookup(table, key, len, _hash(key, len));
+	if (i == -1) {
+		_table_put(table);
+		return NULL;
 	}
-	return -1;
+	return &table->items[i].file;
+}
+
+void content_release(content_file_t *file){
+	_table_put(((item_t *) file)->table);
+}
+
+int content_get(const char *key){
+	content_stall();
+
+	content_file_t *file = content_acquire(key);
+	if (file == NULL)
+		return -1;
+	int fd = file->fildes;
+	content_release(file);
+	return fd;
+}
+
+off_t content_size(const char *key){
+	content_file_t *file = content_acquire(key);
+	struct stat file_stat;
+	off_t size = -1;
+	if (file != NULL) {
+		if (fstat(file->fildes, &file_stat) == 0)
+			size = file_stat.st_size;
+		content_release(file);
+	}
+	return size;
 }
 
 void content_destroy(){
-	int i;
-	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
-	
-	free(items);
+	content_table_t *table = retired;
+	while (table != NULL) {
+		content_table_t *older = table->older;
+		_table_free(table);
+		table = older;
+	}
+	_table_free(current);
+	current = NULL;
+	retired = NULL;
+
+	reader_t *reader = readers;
+	while (reader != NULL) {
+		reader_t *next = reader->next;
+		free(reader);
+		reader = next;
+	}
+	readers = NULL;
+	self = NULL;
+	free(map_filename);
 }
@@ -1,6 +1,35 @@
 #ifndef __CONTENT_H__
 #define __CONTENT_H__
 
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Flags for content_set_mapping.  CONTENT_MAP maps every file into memory
+ * at content_init; CONTENT_MAP_POPULATE also faults the mappings in up
+ * front, asking for huge pages where the kernel supports them.
+ */
+#define CONTENT_MAP          0x1
+#define CONTENT_MAP_POPULATE 0x2
+
+/*
+ * A file of the content map as loaded by content_init or content_reload.
+ * It stays open, and mapped if mapping is enabled, until released, even
+ * if the content is reloaded in the meantime.
+ */
+typedef struct {
+	int fildes;
+	size_t size;           /* when loaded */
+	const char *version;   /* built from its size and modification time */
+	const char *data;      /* NULL unless mapped */
+} content_file_t;
+
+/*
+ * Selects how content_init stores the files, see the flags above.  Must be
+ * called before content_init.  By default files are only opened.
+ */
+void content_set_mapping(int flags);
+
 /* 
  * Initializes the content library given the information from
  * the provided file.  Each row of the file is assumed
@@ -13,12 +42,46 @@
  */
 int content_init(const char *filename);
 
+/*
+ * Reads the file given to content_init again and atomically replaces the
+ * content with it.  Lookups running concurrently never block and see
+ * either the old or the new content; files acquired from the old content
+ * stay valid until released.  Returns 0 on success, or -1 if the new
+ * content cannot be loaded, in which case the old one is kept.
+ */
+int content_reload();
+
+/*
+ * Returns the file associated with the input key, or NULL if the key is
+ * not found.  The file must be handed back with content_release.  Unlike
+ * content_get, it is not delayed.
+ */
+content_file_t *content_acquire(const char *key);
+
+/*
+ * Releases a file obtained from content_acquire.
+ */
+void content_release(content_file_t *file);
+
+/*
+ * Waits for the configured content delay, as content_get does.  Callers
+ * reading an acquired file from disk call it first.
+ */
+void content_stall();
+
 /* 
  * Returns the file descriptor associated with the input key.
- * Returns -1 if the the key is not found
+ * Returns -1 if the the key is not found.  The descriptor is only valid
+ * until the content is reloaded; use content_acquire to keep it longer.
  */
 int content_get(const char *key);
 
+/*
+ * Returns the current size of the file associated with the input key,
+ * or -1 if the key is not found.  Unlike content_get, it is not delayed.
+ */
+off_t content_size(const char *key);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
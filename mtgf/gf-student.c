@@ -1,5 +0,0 @@
-/*
- *  This file is for use by students to define anything they wish.  It is used by both the gf server and client implementations
- */
-
-#include "gf-student.h"
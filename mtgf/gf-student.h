@@ -1,21 +1,7 @@
 /*
  *  This file is for use by students to define anything they wish.  It is used by both the gf server and client implementations
+ *
+ *  mtgf shares gflib's helpers: gf-student.o is built from gflib/gf-student.c,
+ *  so its declarations come from the matching header rather than a copy.
  */
-#ifndef __GF_STUDENT_H__
-#define __GF_STUDENT_H__
-
-#include <errno.h>
-#include <stdio.h>
-#include <regex.h>
-#include <string.h>
-#include <unistd.h>
-#include <resolv.h>
-#include <netdb.h>
-#include <getopt.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <sys/signal.h>
-
- #endif // __GF_STUDENT_H__
+#include "../gflib/gf-student.h"
@@ -1,11 +1,20 @@
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "gfclient-student.h"
 #include "steque.h"
+#include "histogram.h"
 
 #define MAX_THREADS 1024
 #define PATH_BUFFER_SIZE 512
+#define MAX_SEGMENTS 64
+#define MIN_SEGMENT_SIZE (256 * 1024)
+#define CHECKPOINT_BYTES (1024 * 1024)
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 5000
 
 #define USAGE                                                             \
   "usage:\n"                                                              \
@@ -16,7 +25,19 @@
   "  -t [nthreads]       Number of threads (Default 8 Max: 1024)\n"       \
   "  -w [workload_path]  Path to workload file (Default: workload.txt)\n" \
   "  -s [server_addr]    Server address (Default: 127.0.0.1)\n"           \
-  "  -n [num_requests]   Request download total (Default: 16)\n"
+  "  -n [num_requests]   Request download total (Default: 16)\n"         \
+  "  -k                  Reuse one keep-alive connection per thread\n"     \
+  "  -A [inflight]       Download from one thread, up to inflight at once\n" \
+  "  -B [nconnects]      Benchmark: open nconnects connections at once\n"  \
+  "  -G [nsegments]      Fetch each file as up to nsegments ranges at once\n" \
+  "  -X [retries]        Keep partial files and resume them up to retries times\n" \
+  "  -D [cache_dir]      Keep downloads in cache_dir and only fetch them again\n" \
+  "                      once they changed\n"                              \
+  "  -R [rate]           Benchmark: open-loop requests/s, no files kept\n" \
+  "  -M [mode]           Path selection: seq, rnd, zipf or weighted\n"    \
+  "  -a [alpha]          Skew of the zipf mode (Default: 1.0)\n"          \
+  "  -T [trace_path]     Replay a \"<seconds> <path>\" trace instead of\n" \
+  "                      the workload, at its own pace in benchmarks\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
@@ -26,6 +47,16 @@ static struct option gLongOptions[] = {
     {"nthreads", required_argument, NULL, 't'},
     {"workload", required_argument, NULL, 'w'},
     {"nrequests", required_argument, NULL, 'n'},
+    {"keepalive", no_argument, NULL, 'k'},
+    {"async", required_argument, NULL, 'A'},
+    {"burst", required_argument, NULL, 'B'},
+    {"segments", required_argument, NULL, 'G'},
+    {"resume", required_argument, NULL, 'X'},
+    {"cache", required_argument, NULL, 'D'},
+    {"rate", required_argument, NULL, 'R'},
+    {"mode", required_argument, NULL, 'M'},
+    {"alpha", required_argument, NULL, 'a'},
+    {"trace", required_argument, NULL, 'T'},
     {NULL, 0, NULL, 0}};
 
 typedef struct {
@@ -37,8 +68,33 @@ typedef struct {
   pthread_cond_t* finish_cond;
   char *server;
   unsigned short port;
+  int keepalive;
+  int retries;
+  char *cache_dir;
 } worker_fn_args_t;
 
+// Shared state of an open-loop benchmark run.  Request i is due at
+// start_ns + i * interval_ns no matter how long earlier requests took, and
+// its latency is measured from that due time, so a stalled server shows up
+// as queueing delay instead of silently lowering the offered load.
+typedef struct {
+  char *server;
+  unsigned short port;
+  int keepalive;
+  int trace;
+  long nrequests;
+  long next_request;
+  uint64_t start_ns;
+  uint64_t interval_ns;
+} bench_args_t;
+
+typedef struct {
+  bench_args_t *bench;
+  hist_t latency;
+  size_t bytes;
+  long errors;
+} bench_worker_t;
+
 static void Usage() { fprintf(stderr, "%s", USAGE); }
 
 static void localPath(char *req_path, char *local_path) {
@@ -81,14 +137,641 @@ static void writecb(void *data, size_t data_len, void *arg) {
   fwrite(data, 1, data_len, file);
 }
 
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void countcb(void *data, size_t data_len, void *arg) {
+  // Benchmark mode discards the body
+}
+
+// Benchmark worker: claims the next request slot, waits for its due time
+// and records its latency in microseconds
+void* bench_fn(void* arg) {
+  bench_worker_t *worker = (bench_worker_t*)arg;
+  bench_args_t *bench = worker->bench;
+  gfcconn_t *conn = NULL;
+
+  if (bench->keepalive) {
+    conn = gfc_conn_create(bench->server, bench->port);
+  }
+
+  while (1) {
+    long i = __sync_fetch_and_add(&bench->next_request, 1);
+    if (i >= bench->nrequests) {
+      break;
+    }
+
+    double offset;
+    char *path = workload_get_entry(&offset);
+    uint64_t due = bench->start_ns + (bench->trace ? (uint64_t) (offset * 1e9) : i * bench->interval_ns);
+    struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+
+    gfcrequest_t *gfr = gfc_create();
+    gfc_set_path(&gfr, path);
+    gfc_set_port(&gfr, bench->port);
+    gfc_set_server(&gfr, bench->server);
+    gfc_set_writefunc(&gfr, countcb);
+    if (conn) {
+      gfc_set_conn(&gfr, conn);
+    }
+
+    if (gfc_perform(&gfr) < 0 || gfc_get_status(&gfr) != GF_OK) {
+      worker->errors++;
+    }
+    worker->bytes += gfc_get_bytesreceived(&gfr);
+    hist_record(&worker->latency, (now_ns() - due) / 1000);
+    gfc_cleanup(&gfr);
+  }
+
+  gfc_conn_close(&conn);
+  return NULL;
+}
+
+static void run_benchmark(char *server, unsigned short port, int keepalive,
+                          int nthreads, long nrequests, double rate, int trace) {
+  bench_args_t bench = {0};
+  bench.server = server;
+  bench.port = port;
+  bench.keepalive = keepalive;
+  bench.trace = trace;
+  bench.nrequests = nrequests;
+  bench.next_request = 0;
+  bench.interval_ns = rate > 0 ? (uint64_t) (1e9 / rate) : 0;
+
+  pthread_t *tids = malloc(sizeof(pthread_t) * nthreads);
+  bench_worker_t *workers = malloc(sizeof(bench_worker_t) * nthreads);
+
+  // Leave the threads a moment to start before the first request is due
+  bench.start_ns = now_ns() + 10000000ULL;
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].bench = &bench;
+    hist_init(&workers[i].latency);
+    workers[i].bytes = 0;
+    workers[i].errors = 0;
+    pthread_create(&tids[i], NULL, bench_fn, &workers[i]);
+  }
+
+  hist_t latency;
+  hist_init(&latency);
+  size_t bytes = 0;
+  long errors = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(tids[i], NULL);
+    hist_add(&latency, &workers[i].latency);
+    bytes += workers[i].bytes;
+    errors += workers[i].errors;
+  }
+  double elapsed = (now_ns() - bench.start_ns) / 1e9;
+
+  if (trace) {
+    fprintf(stdout, "Requests:    %ld replayed from trace, %ld errors\n", nrequests, errors);
+  } else {
+    fprintf(stdout, "Requests:    %ld at target %.1f req/s, %ld errors\n", nrequests, rate, errors);
+  }
+  fprintf(stdout, "Throughput:  %.1f req/s, %.2f MB/s over %.3f s\n",
+          nrequests / elapsed, bytes / elapsed / 1e6, elapsed);
+  fprintf(stdout, "Latency us:  mean %.0f  p50 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+          hist_mean(&latency),
+          (unsigned long) hist_percentile(&latency, 50.0),
+          (unsigned long) hist_percentile(&latency, 99.0),
+          (unsigned long) hist_percentile(&latency, 99.9),
+          (unsigned long) latency.max);
+
+  free(workers);
+  free(tids);
+}
+
+// Shared state of a connection burst, filled in by burst_donecb
+typedef struct {
+  uint64_t start_ns;
+  hist_t latency;
+  size_t bytes;
+  long errors;
+} burst_t;
+
+static void burst_donecb(gfcrequest_t **gfr, int returncode, void *arg) {
+  burst_t *burst = (burst_t *)arg;
+
+  if (returncode < 0 || gfc_get_status(gfr) != GF_OK) {
+    burst->errors++;
+  }
+  burst->bytes += gfc_get_bytesreceived(gfr);
+  hist_record(&burst->latency, (now_ns() - burst->start_ns) / 1000);
+  gfc_cleanup(gfr);
+}
+
+// Starts nconnects requests at the same instant from one thread and
+// reports how long each took to complete.  With small files that is
+// dominated by the time the connection waits to be accepted, which is
+// where a short listen backlog or a slow accept loop shows up.
+static int run_burst(char *server, unsigned short port, int nconnects) {
+  // Every connection needs a descriptor of its own
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  gfcmulti_t *multi = gfc_multi_create(nconnects < 4096 ? nconnects : 4096);
+  if (multi == NULL) {
+    return -1;
+  }
+
+  burst_t burst;
+  hist_init(&burst.latency);
+  burst.bytes = 0;
+  burst.errors = 0;
+  burst.start_ns = now_ns();
+  for (int i = 0; i < nconnects; i++) {
+    gfcrequest_t *gfr = gfc_create();
+    gfc_set_path(&gfr, workload_get_path());
+    gfc_set_port(&gfr, port);
+    gfc_set_server(&gfr, server);
+    gfc_set_writefunc(&gfr, countcb);
+    gfc_multi_add(multi, &gfr, burst_donecb, &burst);
+  }
+  while (gfc_multi_pending(multi) > 0) {
+    if (gfc_multi_wait(multi, gfc_multi_pending(multi)) < 0) {
+      break;
+    }
+  }
+  double elapsed = (now_ns() - burst.start_ns) / 1e9;
+  gfc_multi_cleanup(&multi);
+
+  fprintf(stdout, "Connections: %d at once, %ld errors\n", nconnects, burst.errors);
+  fprintf(stdout, "Throughput:  %.1f conn/s, %.2f MB/s over %.3f s\n",
+          nconnects / elapsed, burst.bytes / elapsed / 1e6, elapsed);
+  fprintf(stdout, "Latency us:  mean %.0f  p50 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+          hist_mean(&burst.latency),
+          (unsigned long) hist_percentile(&burst.latency, 50.0),
+          (unsigned long) hist_percentile(&burst.latency, 99.0),
+          (unsigned long) hist_percentile(&burst.latency, 99.9),
+          (unsigned long) burst.latency.max);
+  return 0;
+}
+
+// A download in flight on the multi handle
+typedef struct {
+  FILE *file;
+  char *req_path;
+  char local_path[PATH_BUFFER_SIZE];
+} async_download_t;
+
+static void async_donecb(gfcrequest_t **gfr, int returncode, void *arg) {
+  async_download_t *download = (async_download_t *)arg;
+
+  fclose(download->file);
+  if (returncode < 0) {
+    fprintf(stderr, "gfc_perform returned an error %d\n", returncode);
+  }
+  if (returncode < 0 || gfc_get_status(gfr) != GF_OK) {
+    if (0 > unlink(download->local_path)) {
+      fprintf(stderr, "warning: unlink failed on %s\n", download->local_path);
+    }
+  }
+  fprintf(stdout, "Received %zu of %zu bytes of %s\n", gfc_get_bytesreceived(gfr),
+          gfc_get_filelen(gfr), download->req_path);
+
+  gfc_cleanup(gfr);
+  free(download);
+}
+
+// Downloads nrequests files from the calling thread, keeping up to
+// inflight transfers going at once on a multi handle
+static int run_async(char *server, unsigned short port, int nrequests, int inflight) {
+  gfcmulti_t *multi = gfc_multi_create(inflight < 4096 ? inflight : 4096);
+  if (multi == NULL) {
+    return -1;
+  }
+
+  int issued = 0;
+  while (issued < nrequests || gfc_multi_pending(multi) > 0) {
+    while (issued < nrequests && gfc_multi_pending(multi) < inflight) {
+      char *req_path = workload_get_path();
+      issued++;
+      if (strlen(req_path) >= PATH_BUFFER_SIZE) {
+        fprintf(stderr, "Request path exceeded maximum of %d characters\n.", PATH_BUFFER_SIZE);
+        continue;
+      }
+
+      async_download_t *download = malloc(sizeof(async_download_t));
+      download->req_path = req_path;
+      localPath(req_path, download->local_path);
+      download->file = openFile(download->local_path);
+
+      gfcrequest_t *gfr = gfc_create();
+      gfc_set_path(&gfr, req_path);
+      gfc_set_port(&gfr, port);
+      gfc_set_server(&gfr, server);
+      gfc_set_writearg(&gfr, download->file);
+      gfc_set_writefunc(&gfr, writecb);
+
+      fprintf(stdout, "Requesting %s%s\n", server, req_path);
+      gfc_multi_add(multi, &gfr, async_donecb, download);
+    }
+
+    if (gfc_multi_wait(multi, 1) < 0) {
+      break;
+    }
+  }
+
+  gfc_multi_cleanup(&multi);
+  fprintf(stdout, "All tasks finished\n");
+  return 0;
+}
+
+// One range of a segmented download, written in place as it arrives
+typedef struct {
+  char *server;
+  unsigned short port;
+  char *req_path;
+  int keepalive;
+  int fd;
+  size_t offset;
+  size_t length;
+  size_t written;
+  int failed;
+} segment_t;
+
+static void segmentcb(void *data, size_t data_len, void *arg) {
+  segment_t *segment = (segment_t *)arg;
+  size_t done = 0;
+
+  while (done < data_len && !segment->failed) {
+    ssize_t written = pwrite(segment->fd, (char *)data + done, data_len - done,
+                             segment->offset + segment->written + done);
+    if (written < 0 && errno != EINTR) {
+      segment->failed = 1;
+    } else if (written > 0) {
+      done += written;
+    }
+  }
+  segment->written += done;
+}
+
+static void* segment_fn(void *arg) {
+  segment_t *segment = (segment_t *)arg;
+
+  gfcrequest_t *gfr = gfc_create();
+  gfc_set_path(&gfr, segment->req_path);
+  gfc_set_port(&gfr, segment->port);
+  gfc_set_server(&gfr, segment->server);
+  gfc_set_range(&gfr, segment->offset, segment->length);
+  gfc_set_keepalive(&gfr, segment->keepalive);
+  gfc_set_writearg(&gfr, segment);
+  gfc_set_writefunc(&gfr, segmentcb);
+
+  if (gfc_perform(&gfr) < 0 || gfc_get_status(&gfr) != GF_OK ||
+      gfc_get_rangeoffset(&gfr) != segment->offset || segment->written != segment->length) {
+    segment->failed = 1;
+  }
+  gfc_cleanup(&gfr);
+  return NULL;
+}
+
+// Downloads req_path to local_path as up to nsegments ranges fetched over
+// parallel connections, kept open between files with keepalive.  A first
+// request for an empty range gets the file size, so the file can be
+// preallocated and every range written in place.
+static int download_segmented(char *server, unsigned short port, int keepalive,
+                              char *req_path, char *local_path, int nsegments) {
+  gfcrequest_t *gfr = gfc_create();
+  gfc_set_path(&gfr, req_path);
+  gfc_set_port(&gfr, port);
+  gfc_set_server(&gfr, server);
+  gfc_set_range(&gfr, 0, 0);
+  gfc_set_keepalive(&gfr, keepalive);
+  if (gfc_perform(&gfr) < 0 || gfc_get_status(&gfr) != GF_OK) {
+    fprintf(stderr, "Unable to get the size of %s: %s\n", req_path,
+            gfc_strstatus(gfc_get_status(&gfr)));
+    gfc_cleanup(&gfr);
+    return -1;
+  }
+  size_t total = gfc_get_totallen(&gfr);
+  gfc_cleanup(&gfr);
+
+  FILE *file = openFile(local_path);
+  int fd = fileno(file);
+  if (total > 0 && posix_fallocate(fd, 0, total) != 0 && ftruncate(fd, total) != 0) {
+    perror("Unable to preallocate file");
+    fclose(file);
+    unlink(local_path);
+    return -1;
+  }
+
+  // Small files are not worth the extra connections
+  size_t nranges = total / MIN_SEGMENT_SIZE;
+  if (nranges > (size_t) nsegments) {
+    nranges = nsegments;
+  }
+  if (nranges == 0) {
+    nranges = 1;
+  }
+
+  segment_t segments[MAX_SEGMENTS];
+  pthread_t tids[MAX_SEGMENTS];
+  size_t offset = 0;
+  for (size_t i = 0; i < nranges; i++) {
+    segments[i].server = server;
+    segments[i].port = port;
+    segments[i].req_path = req_path;
+    segments[i].keepalive = keepalive;
+    segments[i].fd = fd;
+    segments[i].offset = offset;
+    segments[i].length = total / nranges + (i < total % nranges ? 1 : 0);
+    segments[i].written = 0;
+    segments[i].failed = 0;
+    offset += segments[i].length;
+    pthread_create(&tids[i], NULL, segment_fn, &segments[i]);
+  }
+
+  size_t received = 0;
+  int failed = 0;
+  for (size_t i = 0; i < nranges; i++) {
+    pthread_join(tids[i], NULL);
+    received += segments[i].written;
+    failed |= segments[i].failed;
+  }
+  fclose(file);
+
+  if (failed) {
+    fprintf(stderr, "Segmented download of %s failed\n", req_path);
+    if (0 > unlink(local_path)) {
+      fprintf(stderr, "warning: unlink failed on %s\n", local_path);
+    }
+  }
+  fprintf(stdout, "Received %zu of %zu bytes of %s in %zu segments\n", received, total,
+          req_path, nranges);
+  return failed ? -1 : 0;
+}
+
+// Downloads nrequests files one after the other, each split into ranges
+static void run_segmented(char *server, unsigned short port, int keepalive, int nrequests,
+                          int nsegments) {
+  char local_path[PATH_BUFFER_SIZE];
+
+  for (int i = 0; i < nrequests; i++) {
+    char *req_path = workload_get_path();
+    if (strlen(req_path) >= PATH_BUFFER_SIZE) {
+      fprintf(stderr, "Request path exceeded maximum of %d characters\n.", PATH_BUFFER_SIZE);
+      continue;
+    }
+    localPath(req_path, local_path);
+    fprintf(stdout, "Requesting %s%s\n", server, req_path);
+    download_segmented(server, port, keepalive, req_path, local_path, nsegments);
+  }
+  fprintf(stdout, "All tasks finished\n");
+}
+
+// A resumable download.  Bytes are written in place at their offset, and
+// every CHECKPOINT_BYTES the file is synced and the offset recorded in a
+// "<local_path>.part" file next to it, holding "<offset> <total>".
+typedef struct {
+  int fd;
+  char part_path[PATH_BUFFER_SIZE + 8];
+  size_t offset;
+  size_t total;
+  size_t unsynced;
+  int failed;
+} resume_t;
+
+// Makes everything written so far durable and records how far it goes
+static void resume_checkpoint(resume_t *resume) {
+  char tmp_path[PATH_BUFFER_SIZE + 16];
+  FILE *part;
+
+  if (fdatasync(resume->fd) != 0) {
+    return;
+  }
+  resume->unsynced = 0;
+
+  // Written aside and renamed, so a crash leaves the old checkpoint whole
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", resume->part_path);
+  if (NULL == (part = fopen(tmp_path, "w"))) {
+    return;
+  }
+  fprintf(part, "%zu %zu\n", resume->offset, resume->total);
+  if (fflush(part) == 0 && fdatasync(fileno(part)) == 0) {
+    rename(tmp_path, resume->part_path);
+  }
+  fclose(part);
+}
+
+static void resumecb(void *data, size_t data_len, void *arg) {
+  resume_t *resume = (resume_t *)arg;
+  size_t done = 0;
+
+  while (done < data_len && !resume->failed) {
+    ssize_t written = pwrite(resume->fd, (char *)data + done, data_len - done, resume->offset);
+    if (written < 0 && errno != EINTR) {
+      resume->failed = 1;
+    } else if (written > 0) {
+      done += written;
+      resume->offset += written;
+      resume->unsynced += written;
+    }
+  }
+  if (resume->unsynced >= CHECKPOINT_BYTES) {
+    resume_checkpoint(resume);
+  }
+}
+
+// Sleeps for an exponential backoff with jitter before retry attempt
+static void resume_backoff(int attempt) {
+  long ms = BACKOFF_MIN_MS << (attempt < 6 ? attempt : 6);
+  if (ms > BACKOFF_MAX_MS) {
+    ms = BACKOFF_MAX_MS;
+  }
+  ms = ms / 2 + rand() % (ms / 2 + 1);
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+  }
+}
+
+// Downloads req_path to local_path, retrying up to retries times after a
+// failed transfer.  Each retry asks for the range past the bytes already
+// received, and a checkpoint left by an earlier run is picked up the same
+// way.  The partial file is only removed when the server answers with an
+// error or the file changed size in between.
+static int download_resumable(char *server, unsigned short port, gfcconn_t *conn,
+                              char *req_path, char *local_path, int retries) {
+  resume_t resume;
+  FILE *part;
+  int returncode = -1;
+  gfstatus_t status = GF_INVALID;
+
+  resume.offset = 0;
+  resume.total = 0;
+  resume.unsynced = 0;
+  resume.failed = 0;
+  snprintf(resume.part_path, sizeof(resume.part_path), "%s.part", local_path);
+  if (NULL != (part = fopen(resume.part_path, "r"))) {
+    if (fscanf(part, "%zu %zu", &resume.offset, &resume.total) != 2) {
+      resume.offset = 0;
+      resume.total = 0;
+    }
+    fclose(part);
+  }
+
+  // openFile truncates, which only suits a fresh download
+  resume.fd = resume.offset > 0 ? open(local_path, O_WRONLY) : -1;
+  if (resume.fd < 0) {
+    resume.offset = 0;
+    resume.total = 0;
+    fclose(openFile(local_path));
+    resume.fd = open(local_path, O_WRONLY);
+  }
+  if (resume.fd < 0) {
+    perror("Unable to open file");
+    return -1;
+  }
+
+  for (int attempt = 0; attempt <= retries; attempt++) {
+    if (attempt > 0) {
+      resume_backoff(attempt - 1);
+      fprintf(stdout, "Resuming %s at %zu of %zu bytes\n", req_path, resume.offset, resume.total);
+    }
+
+    gfcrequest_t *gfr = gfc_create();
+    gfc_set_path(&gfr, req_path);
+    gfc_set_port(&gfr, port);
+    gfc_set_server(&gfr, server);
+    gfc_set_writearg(&gfr, &resume);
+    gfc_set_writefunc(&gfr, resumecb);
+    if (resume.offset > 0) {
+      gfc_set_range(&gfr, resume.offset, SIZE_MAX);
+    }
+    if (conn) {
+      gfc_set_conn(&gfr, conn);
+    }
+
+    size_t start = resume.offset;
+    returncode = gfc_perform(&gfr);
+    status = gfc_get_status(&gfr);
+    // A transfer cut short reports GF_INVALID, but if any body arrived the
+    // header was read and the range it describes is known
+    int answered = (status == GF_OK || resume.offset > start);
+    if (answered && start > 0 &&
+        (gfc_get_rangeoffset(&gfr) != start || gfc_get_totallen(&gfr) != resume.total)) {
+      // The file changed size since the checkpoint, start over
+      fprintf(stderr, "warning: %s changed, restarting it\n", req_path);
+      resume.offset = 0;
+      resume.total = 0;
+      if (ftruncate(resume.fd, 0) == 0) {
+        gfc_cleanup(&gfr);
+        continue;
+      }
+      resume.failed = 1;
+    } else if (answered) {
+      resume.total = gfc_get_totallen(&gfr);
+    }
+    gfc_cleanup(&gfr);
+
+    if (resume.failed) {
+      perror("Unable to write file");
+      break;
+    }
+    if (returncode >= 0 && (status != GF_OK || resume.offset == resume.total)) {
+      // Done, or the server answered with an error retrying will not fix
+      break;
+    }
+    if (returncode < 0) {
+      fprintf(stderr, "gfc_perform returned an error %d\n", returncode);
+    }
+    resume_checkpoint(&resume);
+  }
+  close(resume.fd);
+
+  int complete = (returncode >= 0 && status == GF_OK && resume.offset == resume.total);
+  if (complete || returncode >= 0) {
+    unlink(resume.part_path);
+  }
+  if (!complete && returncode >= 0) {
+    if (0 > unlink(local_path)) {
+      fprintf(stderr, "warning: unlink failed on %s\n", local_path);
+    }
+  }
+  fprintf(stdout, "Received %zu of %zu bytes of %s\n", resume.offset, resume.total, req_path);
+  return complete ? 0 : -1;
+}
+
+// A cache directory holds a copy of every file downloaded, stored under its
+// request path as its version on the first line followed by its content.
+// Requests for a cached file are made conditional on that version, and
+// when the server answers NOT_MODIFIED the copy is used instead.
+
+// Opens the cached copy at cache_path and reads its version, leaving the
+// stream at the content.  Returns NULL if there is none.
+static FILE *cache_open(char *cache_path, char *version, size_t size) {
+  FILE *cached = fopen(cache_path, "r");
+  if (cached == NULL) {
+    return NULL;
+  }
+  if (fgets(version, size, cached) == NULL || version[0] == '\n' ||
+      version[strlen(version) - 1] != '\n') {
+    fclose(cached);
+    return NULL;
+  }
+  version[strlen(version) - 1] = '\0';
+  return cached;
+}
+
+static int copy_stream(FILE *src, FILE *dst) {
+  char buffer[8192];
+  size_t nread;
+
+  while ((nread = fread(buffer, 1, sizeof(buffer), src)) > 0) {
+    if (fwrite(buffer, 1, nread, dst) != nread) {
+      return -1;
+    }
+  }
+  return ferror(src) ? -1 : 0;
+}
+
+// Replaces the cached copy at cache_path with the file just downloaded to
+// local_path.  It is written aside and renamed, so concurrent readers see
+// either copy whole.
+static void cache_store(char *cache_path, const char *version, char *local_path) {
+  char tmp_path[2 * PATH_BUFFER_SIZE + 32];
+  FILE *src, *dst;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%lx.tmp", cache_path, (unsigned long) pthread_self());
+  if (NULL == (src = fopen(local_path, "r"))) {
+    return;
+  }
+  dst = openFile(tmp_path);
+  int rc = (fprintf(dst, "%s\n", version) < 0) ? -1 : copy_stream(src, dst);
+  fclose(src);
+  if (fclose(dst) != 0) {
+    rc = -1;
+  }
+  if (rc == 0 && rename(tmp_path, cache_path) == 0) {
+    return;
+  }
+  unlink(tmp_path);
+}
+
 // Worker function of each thread
 void* worker_fn(void* arg) {
   worker_fn_args_t *args = (worker_fn_args_t*)arg;
   int returncode = 0;
   char *req_path = NULL;
   char local_path[PATH_BUFFER_SIZE];
+  char cache_path[2 * PATH_BUFFER_SIZE];
+  char version[128];
   gfcrequest_t *gfr = NULL;
   FILE *file = NULL;
+  FILE *cached = NULL;
+  gfcconn_t *conn = NULL;
+
+  if (args->keepalive) {
+    conn = gfc_conn_create(args->server, args->port);
+  }
 
   while (1) {
     // Lock mutex and claim a task
@@ -98,6 +781,7 @@ void* worker_fn(void* arg) {
     }
     if (args->shutdown == 1) {
       pthread_mutex_unlock(args->mutex);
+      gfc_conn_close(&conn);
       pthread_exit(NULL);
     }
     req_path = steque_pop(args->queue);
@@ -118,6 +802,17 @@ void* worker_fn(void* arg) {
 
     localPath(req_path, local_path);
 
+    if (args->retries > 0) {
+      download_resumable(args->server, args->port, conn, req_path, local_path, args->retries);
+      pthread_mutex_lock(args->mutex);
+      args->active_workers--;
+      if (steque_isempty(args->queue) && args->active_workers == 0) {
+        pthread_cond_signal(args->finish_cond);
+      }
+      pthread_mutex_unlock(args->mutex);
+      continue;
+    }
+
     file = openFile(local_path);
 
     gfr = gfc_create();
@@ -127,22 +822,43 @@ void* worker_fn(void* arg) {
     gfc_set_server(&gfr, args->server);
     gfc_set_writearg(&gfr, file);
     gfc_set_writefunc(&gfr, writecb);
+    if (conn) {
+      gfc_set_conn(&gfr, conn);
+    }
+    cached = NULL;
+    if (args->cache_dir) {
+      snprintf(cache_path, sizeof(cache_path), "%s%s", args->cache_dir, req_path);
+      // Without a cached copy, still ask for the version to store it with
+      cached = cache_open(cache_path, version, sizeof(version));
+      gfc_set_ifversion(&gfr, cached ? version : "");
+    }
 
     fprintf(stdout, "Requesting %s%s\n", args->server, req_path);
 
+    gfstatus_t status = GF_INVALID;
     if (0 > (returncode = gfc_perform(&gfr))) {
       fprintf(stderr, "gfc_perform returned an error %d\n", returncode);
       fclose(file);
       if (0 > unlink(local_path))
         fprintf(stderr, "warning: unlink failed on %s\n", local_path);
     } else {
+      status = gfc_get_status(&gfr);
+      if (status == GF_NOT_MODIFIED && cached && copy_stream(cached, file) == 0) {
+        fprintf(stdout, "Cached copy of %s is current\n", req_path);
+        status = GF_OK;
+      }
       fclose(file);
     }
+    if (cached) {
+      fclose(cached);
+    }
 
-    if (gfc_get_status(&gfr) != GF_OK) {
+    if (status != GF_OK) {
       if (0 > unlink(local_path)) {
         fprintf(stderr, "warning: unlink failed on %s\n", local_path);
       }
+    } else if (args->cache_dir && gfc_get_status(&gfr) == GF_OK && gfc_get_version(&gfr)[0] != '\0') {
+      cache_store(cache_path, gfc_get_version(&gfr), local_path);
     }
 
     //fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(&gfr)));
@@ -175,11 +891,21 @@ int main(int argc, char **argv) {
   int option_char = 0;
   int nthreads = 8;
   int nrequests = 14;
+  int keepalive = 0;
+  int inflight = 0;
+  int nconnects = 0;
+  int nsegments = 0;
+  int retries = 0;
+  char *cache_dir = NULL;
+  double rate = 0;
+  int workload_mode = WORKLOAD_SEQ;
+  double alpha = 1.0;
+  char *trace_path = NULL;
 
   setbuf(stdout, NULL);  // disable caching
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:kA:B:G:X:D:R:M:a:T:", gLongOptions,
                                     NULL)) != -1) {
     switch (option_char) {
 
@@ -199,6 +925,47 @@ int main(int argc, char **argv) {
       case 't':  // nthreads
         nthreads = atoi(optarg);
         break;
+      case 'M':  // workload mode
+        if (strcmp(optarg, "seq") == 0) {
+          workload_mode = WORKLOAD_SEQ;
+        } else if (strcmp(optarg, "rnd") == 0) {
+          workload_mode = WORKLOAD_RND;
+        } else if (strcmp(optarg, "zipf") == 0) {
+          workload_mode = WORKLOAD_ZIPF;
+        } else if (strcmp(optarg, "weighted") == 0) {
+          workload_mode = WORKLOAD_WEIGHTED;
+        } else {
+          fprintf(stderr, "Unknown workload mode %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'a':  // zipf alpha
+        alpha = atof(optarg);
+        break;
+      case 'T':  // trace
+        trace_path = optarg;
+        break;
+      case 'R':  // rate
+        rate = atof(optarg);
+        break;
+      case 'k':  // keepalive
+        keepalive = 1;
+        break;
+      case 'A':  // async
+        inflight = atoi(optarg);
+        break;
+      case 'B':  // burst
+        nconnects = atoi(optarg);
+        break;
+      case 'G':  // segments
+        nsegments = atoi(optarg);
+        break;
+      case 'X':  // resume retries
+        retries = atoi(optarg);
+        break;
+      case 'D':  // cache directory
+        cache_dir = optarg;
+        break;
       default:
         Usage();
         exit(1);
@@ -210,9 +977,18 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (EXIT_SUCCESS != workload_init(workload_path)) {
-    fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
-    exit(EXIT_FAILURE);
+  if (trace_path) {
+    if (EXIT_SUCCESS != workload_init_trace(trace_path)) {
+      fprintf(stderr, "Unable to load trace file %s.\n", trace_path);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    if (EXIT_SUCCESS != workload_init(workload_path)) {
+      fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
+      exit(EXIT_FAILURE);
+    }
+    workload_set_zipf_alpha(alpha);
+    workload_set_mode(workload_mode);
   }
   if (port > 65331) {
     fprintf(stderr, "Invalid port number\n");
@@ -222,8 +998,38 @@ int main(int argc, char **argv) {
     fprintf(stderr, "Invalid amount of threads\n");
     exit(EXIT_FAILURE);
   }
+  if (nsegments < 0 || nsegments > MAX_SEGMENTS) {
+    fprintf(stderr, "Invalid amount of segments\n");
+    exit(EXIT_FAILURE);
+  }
   gfc_global_init();
 
+  if (rate > 0 || trace_path) {
+    run_benchmark(server, port, keepalive, nthreads, nrequests, rate, trace_path != NULL);
+    gfc_global_cleanup();
+    workload_destroy();
+    return 0;
+  }
+
+  if (nsegments > 0) {
+    run_segmented(server, port, keepalive, nrequests, nsegments);
+    gfc_global_cleanup();
+    workload_destroy();
+    return 0;
+  }
+
+  if (inflight > 0 || nconnects > 0) {
+    int rc = nconnects > 0 ? run_burst(server, port, nconnects)
+                           : run_async(server, port, nrequests, inflight);
+    gfc_global_cleanup();
+    workload_destroy();
+    if (rc < 0) {
+      fprintf(stderr, "Unable to set up asynchronous downloads\n");
+      exit(EXIT_FAILURE);
+    }
+    return 0;
+  }
+
   // add your threadpool creation here
   pthread_mutex_t mutex;
   pthread_cond_t worker_cond;
@@ -245,6 +1051,9 @@ int main(int argc, char **argv) {
   arg.active_workers = 0;
   arg.server = server;
   arg.port = port;
+  arg.keepalive = keepalive;
+  arg.retries = retries;
+  arg.cache_dir = cache_dir;
   arg.worker_cond = &worker_cond;
   arg.finish_cond = &finish_cond;
   arg.mutex = &mutex;
@@ -278,5 +1087,6 @@ int main(int argc, char **argv) {
   free(tids);
   gfc_global_cleanup();  /* use for any global cleanup for AFTER your thread
                           pool has terminated. */
+  workload_destroy();
   return 0;
 }
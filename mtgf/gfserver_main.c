@@ -1,26 +1,59 @@
+#define _GNU_SOURCE
+
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdlib.h>
 
 #include "gfserver-student.h"
 #include "steque.h"
+#include "ringq.h"
+#include "workq.h"
+#include "cache.h"
+#include "content.h"
 
 #define USAGE                                                                                     \
   "usage:\n"                                                                                      \
   "  gfserver_main [options]\n"                                                                   \
   "options:\n"                                                                                    \
   "  -h                  Show this help message.\n"                                               \
-  "  -m [content_file]   Content file mapping keys to content files (Default: content.txt\n"      \
+  "  -e [engine]         Connection engine: blocking, epoll or uring-accept (Default: blocking)\n" \
+  "  -b [backlog]        Pending connections queued by the kernel (Default: 1024)\n"             \
+  "  -q [queue]          Work queue: steque, ring or steal (Default: steque)\n"                 \
+  "  -c [cache_bytes]    Memory budget of the small file cache (Default: 0, disabled)\n"         \
+  "  -s [max_size]       Largest file kept in the small file cache (Default: 65536)\n"           \
+  "  -S [nshards]        Acceptor threads, each with its own listener and workers (Default: 1)\n" \
+  "  -P                  Give each shard's acceptor and workers their own share of the CPUs\n"  \
+  "  -z [small_max]      Serve files up to small_max bytes from their own workers (Default: 0, off)\n" \
+  "  -L [percent]        Share of the workers kept for larger files with -z (Default: 25)\n"     \
+  "  -C [chunk_bytes]    Interleave files above chunk_bytes a chunk at a time (Default: 0, off)\n" \
+  "  -M                  Map all content files into memory and send from the mappings\n"       \
+  "  -H                  With -M, prefault the mappings and ask for huge pages\n"               \
+  "  -m [content_file]   Content file mapping keys to content files, reread on SIGHUP (Default: content.txt\n" \
   "  -t [nthreads]       Number of threads (Default: 16)\n"                                       \
   "  -d [delay]          Delay in content_get, default 0, range 0-5000000 "                       \
   "  -p [listen_port]    Listen port (Default: 29458)\n"                                          \
   "(microseconds)\n "
 
+#define RING_CAPACITY 4096
+
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
     {"nthreads", required_argument, NULL, 't'},
     {"content", required_argument, NULL, 'm'},
     {"port", required_argument, NULL, 'p'},
     {"delay", required_argument, NULL, 'd'},
+    {"engine", required_argument, NULL, 'e'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"queue", required_argument, NULL, 'q'},
+    {"cache", required_argument, NULL, 'c'},
+    {"cache-max", required_argument, NULL, 's'},
+    {"shards", required_argument, NULL, 'S'},
+    {"pin", no_argument, NULL, 'P'},
+    {"small-max", required_argument, NULL, 'z'},
+    {"large-share", required_argument, NULL, 'L'},
+    {"chunk", required_argument, NULL, 'C'},
+    {"mmap", no_argument, NULL, 'M'},
+    {"hugepages", no_argument, NULL, 'H'},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}};
 
@@ -28,7 +61,11 @@ extern unsigned long int content_delay;
 
 extern gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void *arg);
 extern pthread_t* handler_pool_init(int nthreads, void* args);
-extern void* create_worker_args(steque_t* queue, pthread_mutex_t* mutex, pthread_cond_t* cond);
+extern void* create_worker_args(steque_t* queue, pthread_mutex_t* mutex, pthread_cond_t* cond, ringq_t* ring, workq_t* workq);
+extern void set_size_classes(void* small, void* large, size_t small_max);
+extern void chunking_init(size_t chunk_bytes);
+
+static sem_t reload_sem;
 
 static void _sig_handler(int signo) {
   if ((SIGINT == signo) || (SIGTERM == signo)) {
@@ -36,6 +73,64 @@ static void _sig_handler(int signo) {
   }
 }
 
+// sem_post is async-signal-safe, the reload itself happens in reload_fn
+static void _reload_handler(int signo) {
+  sem_post(&reload_sem);
+}
+
+// Reloads the content map on each SIGHUP, without stopping transfers
+static void* reload_fn(void* arg) {
+  while (1) {
+    if (sem_wait(&reload_sem) != 0) {
+      continue;  // EINTR
+    }
+    if (content_reload() == 0) {
+      fprintf(stdout, "Content reloaded\n");
+    } else {
+      fprintf(stderr, "Content reload failed, keeping the current content\n");
+    }
+  }
+  return NULL;
+}
+
+// Starts nthreads workers sharing one queue of the selected kind, allowed
+// to run on CPUs [cpu_lo, cpu_hi) unless cpu_lo is negative
+static void* start_worker_set(int nthreads, int use_ring, int use_steal, int cpu_lo, int cpu_hi) {
+  steque_t *queue = malloc(sizeof(steque_t));
+  pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+  pthread_cond_t *cond = malloc(sizeof(pthread_cond_t));
+  ringq_t *ring = NULL;
+  workq_t *workq = NULL;
+
+  steque_init(queue);
+  pthread_mutex_init(mutex, NULL);
+  pthread_cond_init(cond, NULL);
+  if (use_ring) {
+    ring = malloc(sizeof(ringq_t));
+    ringq_init(ring, RING_CAPACITY);
+  }
+  if (use_steal) {
+    workq = malloc(sizeof(workq_t));
+    workq_init(workq, nthreads);
+  }
+
+  void *args = create_worker_args(queue, mutex, cond, ring, workq);
+  pthread_t *tids = handler_pool_init(nthreads, args);
+
+  if (cpu_lo >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int c = cpu_lo; c < cpu_hi; c++) {
+      CPU_SET(c, &cpus);
+    }
+    for (int j = 0; j < nthreads; j++) {
+      pthread_setaffinity_np(tids[j], sizeof(cpus), &cpus);
+    }
+  }
+  free(tids);
+  return args;
+}
+
 /* Main ========================================================= */
 int main(int argc, char **argv) {
   char *content_map = "content.txt";
@@ -43,6 +138,18 @@ int main(int argc, char **argv) {
   gfserver_t *gfs = NULL;
   int option_char = 0;
   unsigned short port = 29458;
+  gfs_engine_t engine = GFS_ENGINE_BLOCKING;
+  int backlog = 1024;
+  int use_ring = 0;
+  int use_steal = 0;
+  size_t cache_bytes = 0;
+  size_t cache_max_size = 65536;
+  int nshards = 1;
+  size_t small_max = 0;
+  int large_share = 25;
+  size_t chunk_bytes = 0;
+  int pin_cpus = 0;
+  int map_flags = 0;
 
   setbuf(stdout, NULL);
 
@@ -56,8 +163,15 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  // A client dropping the connection mid-response must fail the send, not
+  // kill the server
+  if (SIG_ERR == signal(SIGPIPE, SIG_IGN)) {
+    fprintf(stderr, "Can't ignore SIGPIPE...exiting.\n");
+    exit(EXIT_FAILURE);
+  }
+
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:d:rhm:t:", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "p:d:rhm:t:e:b:q:c:s:S:Pz:L:C:MH", gLongOptions,
                                     NULL)) != -1) {
     switch (option_char) {
       case 'h':  /* help */
@@ -76,6 +190,60 @@ int main(int argc, char **argv) {
       case 'm':  /* file-path */
         content_map = optarg;
         break;
+      case 'b':  /* backlog */
+        backlog = atoi(optarg);
+        break;
+      case 'e':  /* engine */
+        if (strcmp(optarg, "epoll") == 0) {
+          engine = GFS_ENGINE_EPOLL;
+        } else if (strcmp(optarg, "uring-accept") == 0 || strcmp(optarg, "uring") == 0) {
+          engine = GFS_ENGINE_URING_ACCEPT;
+        } else if (strcmp(optarg, "blocking") == 0) {
+          engine = GFS_ENGINE_BLOCKING;
+        } else {
+          fprintf(stderr, "Unknown engine %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'c':  /* cache budget */
+        cache_bytes = strtoul(optarg, NULL, 10);
+        break;
+      case 's':  /* cache object size limit */
+        cache_max_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'S':  /* shards */
+        nshards = atoi(optarg);
+        break;
+      case 'P':  /* pin */
+        pin_cpus = 1;
+        break;
+      case 'z':  /* small file size limit */
+        small_max = strtoul(optarg, NULL, 10);
+        break;
+      case 'L':  /* large file worker share */
+        large_share = atoi(optarg);
+        break;
+      case 'C':  /* chunk size */
+        chunk_bytes = strtoul(optarg, NULL, 10);
+        break;
+      case 'M':  /* mmap */
+        map_flags |= CONTENT_MAP;
+        break;
+      case 'H':  /* huge pages */
+        map_flags |= CONTENT_MAP_POPULATE;
+        break;
+      case 'q':  /* queue */
+        use_ring = 0;
+        use_steal = 0;
+        if (strcmp(optarg, "ring") == 0) {
+          use_ring = 1;
+        } else if (strcmp(optarg, "steal") == 0) {
+          use_steal = 1;
+        } else if (strcmp(optarg, "steque") != 0) {
+          fprintf(stderr, "Unknown queue %s\n", optarg);
+          exit(1);
+        }
+        break;
       default:
         fprintf(stderr, "%s", USAGE);
         exit(1);
@@ -94,28 +262,77 @@ int main(int argc, char **argv) {
     exit(__LINE__);
   }
 
+  if (map_flags & CONTENT_MAP_POPULATE && !(map_flags & CONTENT_MAP)) {
+    fprintf(stderr, "-H requires -M\n");
+    exit(1);
+  }
+  content_set_mapping(map_flags);
   content_init(content_map);
+  cache_init(cache_bytes, cache_max_size);
+
+  pthread_t reload_tid;
+  sem_init(&reload_sem, 0, 0);
+  if (pthread_create(&reload_tid, NULL, reload_fn, NULL) != 0 ||
+      SIG_ERR == signal(SIGHUP, _reload_handler)) {
+    fprintf(stderr, "Can't set up content reloading...exiting.\n");
+    exit(EXIT_FAILURE);
+  }
+  chunking_init(chunk_bytes);
+
+  if (nshards < 1) {
+    nshards = 1;
+  }
+  if (nthreads < nshards) {
+    nthreads = nshards;
+  }
+
+  /* Initialize thread management: one worker set per shard, or two with size classes */
+  void **worker_args = malloc(sizeof(void *) * nshards);
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-  /* Initialize thread management */
-  steque_t queue;
-  steque_init(&queue);
-  pthread_mutex_t mutex;
-  pthread_mutex_init(&mutex, NULL);
-  pthread_cond_t cond;
-  pthread_cond_init(&cond, NULL);
+  for (int i = 0; i < nshards; i++) {
+    // Spread the threads evenly, the first shards taking the remainder
+    int shard_threads = nthreads / nshards + (i < nthreads % nshards);
 
-  void *worker_args = create_worker_args(&queue, &mutex, &cond);
+    // Pinned shards split the CPUs into disjoint ranges, the same ones
+    // gfserver pins their acceptors into; with more shards than CPUs each
+    // shard gets a single CPU, shared round robin
+    int cpu_lo = -1, cpu_hi = -1;
+    if (pin_cpus && ncpus > 0) {
+      cpu_lo = i * ncpus / nshards;
+      cpu_hi = (i + 1) * ncpus / nshards;
+      if (cpu_hi == cpu_lo) {
+        cpu_lo = i % ncpus;
+        cpu_hi = cpu_lo + 1;
+      }
+    }
+
+    int large_threads = 0;
+    if (small_max > 0 && shard_threads > 1) {
+      large_threads = shard_threads * large_share / 100;
+      if (large_threads < 1) large_threads = 1;
+      if (large_threads > shard_threads - 1) large_threads = shard_threads - 1;
+    }
 
-  handler_pool_init(nthreads, worker_args);
+    worker_args[i] = start_worker_set(shard_threads - large_threads, use_ring, use_steal, cpu_lo, cpu_hi);
+    if (large_threads > 0) {
+      set_size_classes(worker_args[i], start_worker_set(large_threads, use_ring, use_steal, cpu_lo, cpu_hi), small_max);
+    }
+  }
 
   /*Initializing server*/
   gfs = gfserver_create();
 
   //Setting options
   gfserver_set_port(&gfs, port);
-  gfserver_set_maxpending(&gfs, 24);
+  gfserver_set_maxpending(&gfs, backlog);
+  gfserver_set_engine(&gfs, engine);
   gfserver_set_handler(&gfs, gfs_handler);
-  gfserver_set_handlerarg(&gfs, worker_args);  // doesn't have to be NULL!
+  gfserver_set_handlerarg(&gfs, worker_args[0]);  // doesn't have to be NULL!
+  if (nshards > 1) {
+    gfserver_set_shards(&gfs, nshards, pin_cpus);
+    gfserver_set_shard_handlerargs(&gfs, worker_args);
+  }
 
   /*Loops forever*/
   gfserver_serve(&gfs);
@@ -1,11 +1,15 @@
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 
 #include "gfserver-student.h"
 #include "gfserver.h"
 #include "workload.h"
 #include "content.h"
 #include "steque.h"
+#include "ringq.h"
+#include "workq.h"
+#include "cache.h"
 
 //
 //  The purpose of this function is to handle a get request
@@ -20,81 +24,276 @@ typedef struct {
 	steque_t* queue;
 	pthread_mutex_t* mutex;
 	pthread_cond_t* cond;
+	ringq_t* ring;  // when set, used instead of queue/mutex/cond
+	workq_t* workq;  // when set, used instead of all of the above
+	int next_worker;  // hands out workq lanes as workers start
+
+	// Size classes: files larger than small_max go to the large worker
+	// set, so short requests never queue behind long transfers
+	void* large;
+	size_t small_max;
 }worker_args;
 
 typedef struct {
 	gfcontext_t *ctx;
 	const char *path;
 	void* arg;
+	content_file_t* file;  // held until the response is done
+
+	// Chunked transfer in progress, fd is -1 until one is started
+	worker_args* owner;
+	int fd;
+	off_t offset;
+	size_t remaining;
 }task_item_t;
 
-worker_args* create_worker_args(steque_t* queue, pthread_mutex_t* mutex, pthread_cond_t* cond) {
+// Chunked mode: files above chunk_size are sent one chunk per turn, and a
+// transfer whose client is not keeping up waits in poll_fd for its socket
+// to drain instead of holding on to a worker
+static size_t chunk_size = 0;
+static int poll_fd = -1;
+
+// Tasks are created on the acceptor and freed on a worker, per request
+static gf_pool_t task_pool;
+static pthread_once_t task_pool_once = PTHREAD_ONCE_INIT;
+
+static void task_pool_init(void) {
+	if (gf_pool_init(&task_pool, sizeof(task_item_t)) != 0) {
+		fprintf(stderr, "Unable to set up the task pool.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+worker_args* create_worker_args(steque_t* queue, pthread_mutex_t* mutex, pthread_cond_t* cond, ringq_t* ring, workq_t* workq) {
+	pthread_once(&task_pool_once, task_pool_init);
+
 	worker_args* arg = malloc(sizeof(worker_args));
 	memset(arg, 0, sizeof(worker_args));
 	arg->queue = queue;
 	arg->mutex = mutex;
 	arg->cond = cond;
+	arg->ring = ring;
+	arg->workq = workq;
 	return arg;
 }
 
+void set_size_classes(void* small, void* large, size_t small_max) {
+	worker_args* args = small;
+	args->large = large;
+	args->small_max = small_max;
+}
+
+static task_item_t* take_task(worker_args* args, int worker) {
+	if (args->workq) {
+		return workq_pop(args->workq, worker);
+	}
+	if (args->ring) {
+		return ringq_pop(args->ring);
+	}
+
+	pthread_mutex_lock(args->mutex);
+	while (steque_isempty(args->queue)) {
+		pthread_cond_wait(args->cond, args->mutex);
+	}
+
+	steque_item item = steque_pop(args->queue);
+	pthread_mutex_unlock(args->mutex);
+	return (task_item_t*)item;
+}
+
+static void finish_task(task_item_t* task) {
+	gfs_finish(&task->ctx);
+	if (task->file) {
+		content_release(task->file);
+	}
+	gf_pool_put(&task_pool, task);
+}
+
+static void abort_task(task_item_t* task) {
+	gfs_abort(&task->ctx);
+	if (task->file) {
+		content_release(task->file);
+	}
+	gf_pool_put(&task_pool, task);
+}
+
+static void send_cached(task_item_t* task, cache_entry_t* entry) {
+	gfs_sendresponse(&task->ctx, entry->data, entry->len);
+	cache_release(entry);
+	finish_task(task);
+}
+
+// Queues the task for the workers of args; with a ring, returns -1 rather
+// than wait when it is full
+static int submit_task(worker_args* args, task_item_t* task, int may_wait) {
+	if (args->workq) {
+		workq_push(args->workq, task);
+		return 0;
+	}
+	if (args->ring) {
+		if (may_wait) {
+			ringq_push(args->ring, task);
+			return 0;
+		}
+		return ringq_trypush(args->ring, task);
+	}
+
+	// steque_push adds at the front; enqueue keeps arrival order
+	pthread_mutex_lock(args->mutex);
+	steque_enqueue(args->queue, task);
+	pthread_cond_signal(args->cond);
+	pthread_mutex_unlock(args->mutex);
+	return 0;
+}
+
+// Sends the next chunk of a chunked transfer, then puts the task at the back
+// of the queue, parks it until its socket is writable, or finishes it.
+static void send_chunk(task_item_t* task) {
+	while (1) {
+		size_t want = task->remaining < chunk_size ? task->remaining : chunk_size;
+		ssize_t sent = gfs_sendfile_some(&task->ctx, task->fd, task->offset, want);
+		if (sent == -1) {
+			abort_task(task);
+			return;
+		}
+		task->offset += sent;
+		task->remaining -= sent;
+		if (task->remaining == 0) {
+			finish_task(task);
+			return;
+		}
+
+		if (sent < want) {
+			struct epoll_event ev;
+			ev.events = EPOLLOUT | EPOLLONESHOT;
+			ev.data.ptr = task;
+			if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, gfs_fd(&task->ctx), &ev) == -1) {
+				abort_task(task);
+			}
+			return;
+		}
+
+		// Let the other queued requests have a turn first
+		if (submit_task(task->owner, task, 0) == 0) {
+			return;
+		}
+	}
+}
+
+// Hands transfers whose socket drained back to the workers
+static void* poll_fn(void* arg) {
+	struct epoll_event events[64];
+	while (1) {
+		int nready = epoll_wait(poll_fd, events, 64, -1);
+		for (int i = 0; i < nready; i++) {
+			task_item_t* task = events[i].data.ptr;
+			epoll_ctl(poll_fd, EPOLL_CTL_DEL, gfs_fd(&task->ctx), NULL);
+			submit_task(task->owner, task, 1);
+		}
+	}
+	return NULL;
+}
+
+void chunking_init(size_t chunk_bytes) {
+	pthread_t tid;
+
+	chunk_size = chunk_bytes;
+	if (chunk_size == 0) {
+		return;
+	}
+	poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (poll_fd == -1 || pthread_create(&tid, NULL, poll_fn, NULL) != 0) {
+		fprintf(stderr, "Unable to start the chunked transfer poller\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
 void* worker_fn(void* arg) {
 	worker_args* args = arg;
+	int worker = __sync_fetch_and_add(&args->next_worker, 1);
 	while (1) {
-		pthread_mutex_lock(args->mutex);
-		while (steque_isempty(args->queue)) {
-			pthread_cond_wait(args->cond, args->mutex);
+		task_item_t* task = take_task(args, worker);
+		if (task->fd != -1) {
+			send_chunk(task);
+			continue;
 		}
+		content_file_t* file = content_acquire(task->path);
+		if (file == NULL) {
+			content_stall();
+			gfs_sendheader(&task->ctx, GF_FILE_NOT_FOUND, 0);
+			finish_task(task);
+			continue;
+		}
+		task->file = file;
+		gfs_set_version(&task->ctx, file->version);
 
-		steque_item item = steque_pop(args->queue);
-		pthread_mutex_unlock(args->mutex);
+		// Mapped files are sent straight from memory, unless chunking
+		// would spread them over several turns
+		if (file->data && (chunk_size == 0 || file->size <= chunk_size)) {
+			gfs_sendresponse(&task->ctx, file->data, file->size);
+			finish_task(task);
+			continue;
+		}
 
-		task_item_t* task = (task_item_t*)item;
-		int fd = content_get(task->path);
-		if (fd == -1) {
-			gfs_sendheader(&task->ctx, GF_FILE_NOT_FOUND, 0);
-			free(task);
+		// Hot small files are served from memory without touching disk
+		cache_entry_t* entry = cache_acquire(task->path, file->version);
+		if (entry) {
+			send_cached(task, entry);
+			continue;
 		}
-		else {
-			struct stat file_stat;
-			if (fstat(fd, &file_stat) == 0) {
-				size_t file_size = file_stat.st_size;
-				gfs_sendheader(&task->ctx, GF_OK, file_size);
-
-				char buffer[8192];  // Fixed size buffer
-				ssize_t bytes_read;
-
-				off_t offset = 0;
-				while (offset < file_size) {
-					bytes_read = pread(fd, buffer, sizeof(buffer), offset);
-					if (bytes_read <= 0) break;
-					gfs_send(&task->ctx, buffer, bytes_read);
-					offset += bytes_read;
+
+		content_stall();
+		struct stat file_stat;
+		if (fstat(file->fildes, &file_stat) == 0) {
+			size_t file_size = file_stat.st_size;
+			if ((entry = cache_load(task->path, file->version, file->fildes, file_size)) != NULL) {
+				send_cached(task, entry);
+				continue;
+			}
+			if (chunk_size > 0 && file_size > chunk_size) {
+				if (gfs_sendheader(&task->ctx, GF_OK, file_size) == -1 ||
+				    gfs_nonblocking(&task->ctx) == -1) {
+					abort_task(task);
+					continue;
 				}
-			} else {
-				gfs_sendheader(&task->ctx, GF_ERROR, 0);
+				task->owner = args;
+				task->fd = file->fildes;
+				task->offset = 0;
+				task->remaining = file_size;
+				send_chunk(task);
+				continue;
 			}
-
-			free(task);
+			// Body goes straight from the page cache to the socket
+			gfs_sendresponse_file(&task->ctx, file->fildes, 0, file_size);
+		} else {
+			gfs_sendheader(&task->ctx, GF_ERROR, 0);
 		}
+
+		finish_task(task);
 	}
 }
 
 gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void* arg){
 	worker_args *args = arg;
-	steque_t* queue = args->queue;
-	pthread_mutex_t* mutex = args->mutex;
-	pthread_cond_t* cond = args->cond;
 
-	task_item_t* task = malloc(sizeof(task_item_t));
+	// Files that do not exist count as small, their answer is quick
+	if (args->large && content_size(path) > (off_t) args->small_max) {
+		args = args->large;
+	}
+
+	task_item_t* task = gf_pool_get(&task_pool);
+	if (task == NULL) {
+		gfs_sendheader(ctx, GF_ERROR, 0);
+		return gfh_failure;
+	}
 	task->ctx = *ctx;
 	*ctx = NULL;
 	task->path = path;
+	task->file = NULL;
+	task->owner = args;
+	task->fd = -1;
 
-	pthread_mutex_lock(mutex);
-	steque_push(queue, task);
-	pthread_cond_signal(cond);
-	pthread_mutex_unlock(mutex);
-
+	submit_task(args, task, 1);
 	return gfh_success;
 }
 
@@ -0,0 +1,142 @@
+// Times the GETFILE header scans and status-token compares on short,
+// realistic headers: gf_find_header_end (AVX2/SSE2 where the CPU has them)
+// against a byte loop and a memchr+memcmp scan, and the client's status
+// dispatch with gf_token_equal against memcmp and a byte loop.  Build with "make header_bench".
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gf-student.h"
+
+#define ROUNDS 2000000
+
+static const char *headers[] = {
+  "GETFILE GET /courses/ud923/filecorpus/1kb-sample-file-1.html\r\n\r\n",
+  "GETFILE GET /courses/ud923/filecorpus/road.jpg\r\n\r\n",
+  "GETFILE OK 1048576 VERSION 100000-65a3f1c2.0\r\n\r\n",
+  "GETFILE OK 4096 RANGE 0 1048576 KEEPALIVE\r\n\r\n",
+  "GETFILE FILE_NOT_FOUND\r\n\r\n",
+  "GETFILE OK 96\r\n\r\n",
+};
+#define NHEADERS (sizeof(headers) / sizeof(headers[0]))
+
+static const char *statuses[] = {"OK", "FILE_NOT_FOUND", "ERROR", "NOT_MODIFIED"};
+#define NSTATUSES (sizeof(statuses) / sizeof(statuses[0]))
+
+// Keeps the compiler from dropping the timed calls
+static volatile long sink;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t scan_bytes(const char *buffer, ssize_t start, ssize_t length) {
+  for (ssize_t i = start; i + 3 < length; i++) {
+    if (buffer[i] == '\r' && buffer[i + 1] == '\n' && buffer[i + 2] == '\r' && buffer[i + 3] == '\n')
+      return i;
+  }
+  return -1;
+}
+
+static ssize_t scan_memchr(const char *buffer, ssize_t start, ssize_t length) {
+  ssize_t i = start;
+  while (i + 3 < length) {
+    const char *cr = memchr(buffer + i, '\r', length - 3 - i);
+    if (cr == NULL)
+      return -1;
+    i = cr - buffer;
+    if (memcmp(cr, "\r\n\r\n", 4) == 0)
+      return i;
+    i++;
+  }
+  return -1;
+}
+
+static int token_bytes(const char *p, const char *token, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] != token[i])
+      return 0;
+  }
+  return 1;
+}
+
+static int token_memcmp(const char *p, const char *token, size_t len) {
+  return memcmp(p, token, len) == 0;
+}
+
+// The status dispatch of gfc_parse_header, with each compare inlined at
+// its constant length
+#define CLASSIFY(name, equal)                                              \
+  static int name(const char *p, size_t len) {                             \
+    if (len == 2 && equal(p, "OK", 2)) return 1;                            \
+    if (len == 14 && equal(p, "FILE_NOT_FOUND", 14)) return 2;              \
+    if (len == 5 && equal(p, "ERROR", 5)) return 3;                         \
+    if (len == 12 && equal(p, "NOT_MODIFIED", 12)) return 4;                \
+    return 0;                                                              \
+  }
+CLASSIFY(classify_words, gf_token_equal)
+CLASSIFY(classify_memcmp, token_memcmp)
+CLASSIFY(classify_bytes, token_bytes)
+
+// Copies of the inputs in heap buffers, so the scans cannot be folded
+static char *buffers[NHEADERS];
+static ssize_t lengths[NHEADERS];
+static char *tokens[NSTATUSES];
+static size_t token_lengths[NSTATUSES];
+
+static void time_scan(const char *name, ssize_t (*scan)(const char *, ssize_t, ssize_t)) {
+  double start = now();
+  long found = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    for (size_t h = 0; h < NHEADERS; h++)
+      found += scan(buffers[h], 0, lengths[h]);
+  }
+  double elapsed = now() - start;
+  sink = found;
+  printf("  %-24s %6.2f ns/header\n", name, elapsed * 1e9 / ((double) ROUNDS * NHEADERS));
+}
+
+static void time_token(const char *name, int (*classify)(const char *, size_t)) {
+  double start = now();
+  long matches = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    for (size_t t = 0; t < NSTATUSES; t++)
+      matches += classify(tokens[t], token_lengths[t]);
+  }
+  double elapsed = now() - start;
+  sink = matches;
+  printf("  %-24s %6.2f ns/token\n", name, elapsed * 1e9 / ((double) ROUNDS * NSTATUSES));
+}
+
+int main() {
+  double bytes = 0;
+  for (size_t h = 0; h < NHEADERS; h++) {
+    lengths[h] = strlen(headers[h]);
+    buffers[h] = malloc(lengths[h]);
+    memcpy(buffers[h], headers[h], lengths[h]);
+    bytes += lengths[h];
+  }
+  for (size_t t = 0; t < NSTATUSES; t++) {
+    tokens[t] = strdup(statuses[t]);
+    token_lengths[t] = strlen(statuses[t]);
+  }
+
+  printf("header end, %zu headers of %.0f bytes on average:\n", NHEADERS, bytes / NHEADERS);
+  time_scan("gf_find_header_end", gf_find_header_end);
+  time_scan("byte loop", scan_bytes);
+  time_scan("memchr+memcmp", scan_memchr);
+
+  printf("status token:\n");
+  time_token("gf_token_equal", classify_words);
+  time_token("memcmp", classify_memcmp);
+  time_token("byte loop", classify_bytes);
+
+  for (size_t h = 0; h < NHEADERS; h++)
+    free(buffers[h]);
+  for (size_t t = 0; t < NSTATUSES; t++)
+    free(tokens[t]);
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static int hist_index(uint64_t value) {
+  if (value < 2 * HIST_SUB_BUCKETS)
+    return (int) value;
+
+  // value = m << e with m in [64, 128)
+  int e = 63 - __builtin_clzll(value) - 6;
+  uint64_t m = value >> e;
+  return 2 * HIST_SUB_BUCKETS + (e - 1) * HIST_SUB_BUCKETS + (int) (m - HIST_SUB_BUCKETS);
+}
+
+// Largest value that falls into bucket index
+static uint64_t hist_value(int index) {
+  if (index < 2 * HIST_SUB_BUCKETS)
+    return index;
+
+  int e = (index - 2 * HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + 1;
+  uint64_t m = (index - 2 * HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+  return (m << e) + ((1ULL << e) - 1);
+}
+
+void hist_init(hist_t *hist) {
+  memset(hist, 0, sizeof(hist_t));
+  hist->min = UINT64_MAX;
+}
+
+void hist_record(hist_t *hist, uint64_t value) {
+  hist->counts[hist_index(value)]++;
+  hist->total++;
+  hist->sum += value;
+  if (value < hist->min)
+    hist->min = value;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+void hist_add(hist_t *dst, const hist_t *src) {
+  for (int i = 0; i < HIST_NBUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+uint64_t hist_percentile(const hist_t *hist, double percentile) {
+  if (hist->total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t) (percentile / 100.0 * hist->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_NBUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) {
+      uint64_t value = hist_value(i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+double hist_mean(const hist_t *hist) {
+  return hist->total ? hist->sum / hist->total : 0.0;
+}
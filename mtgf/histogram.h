@@ -0,0 +1,42 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: values below
+ * 128 are counted exactly, larger ones in 64 sub-buckets per power of two,
+ * so any recorded value is reported to within about 1.6%.  A histogram is
+ * not thread-safe; give each thread its own and merge them with hist_add.
+ */
+
+#define HIST_SUB_BUCKETS 64
+#define HIST_NBUCKETS (2 * HIST_SUB_BUCKETS + 57 * HIST_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t counts[HIST_NBUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+} hist_t;
+
+/* Empties the histogram */
+void hist_init(hist_t *hist);
+
+/* Counts one occurrence of value */
+void hist_record(hist_t *hist, uint64_t value);
+
+/* Adds every count of src into dst */
+void hist_add(hist_t *dst, const hist_t *src);
+
+/*
+ * Returns the smallest recorded value (within the histogram's precision)
+ * that at least percentile percent of recorded values do not exceed.
+ */
+uint64_t hist_percentile(const hist_t *hist, double percentile);
+
+/* Returns the arithmetic mean of the recorded values */
+double hist_mean(const hist_t *hist);
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "ringq.h"
+
+#define RINGQ_SPINS 64
+
+static void futex_wait(unsigned int* addr, unsigned int expected){
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int* addr, int nwake){
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nwake, NULL, NULL, 0);
+}
+
+void ringq_init(ringq_t* ring, size_t capacity){
+  size_t size = 2;
+  while (size < capacity)
+    size <<= 1;
+
+  ring->cells = (ringq_cell_t*) malloc(size * sizeof(ringq_cell_t));
+  for (size_t i = 0; i < size; i++)
+    ring->cells[i].seq = i;
+  ring->mask = size - 1;
+  ring->enqueue_pos = 0;
+  ring->dequeue_pos = 0;
+  ring->items_epoch = 0;
+  ring->slots_epoch = 0;
+  ring->idle_consumers = 0;
+  ring->idle_producers = 0;
+}
+
+/*
+ * Each cell carries a sequence number telling whose turn it is: seq == pos
+ * means free for the producer claiming pos, seq == pos + 1 means filled for
+ * the consumer claiming pos.  Positions are claimed with a CAS, so the only
+ * shared writes on the fast path are one CAS and one release store.
+ */
+int ringq_trypush(ringq_t* ring, ringq_item item){
+  size_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+  ringq_cell_t* cell;
+
+  while (1) {
+    cell = &ring->cells[pos & ring->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->item = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+ringq_item ringq_trypop(ringq_t* ring){
+  size_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+  ringq_cell_t* cell;
+
+  while (1) {
+    cell = &ring->cells[pos & ring->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  ringq_item item = cell->item;
+  __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+/*
+ * Wakes one thread parked on epoch.  The fence orders the preceding ring
+ * update before the idle check; it pairs with the fence in a parking
+ * thread between announcing itself idle and re-checking the ring, so at
+ * least one side always sees the other.
+ */
+static void ringq_signal(unsigned int* epoch, int* idle){
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(idle, __ATOMIC_RELAXED) > 0) {
+    __atomic_add_fetch(epoch, 1, __ATOMIC_RELEASE);
+    futex_wake(epoch, 1);
+  }
+}
+
+void ringq_push(ringq_t* ring, ringq_item item){
+  int spins = 0;
+
+  while (ringq_trypush(ring, item) != 0) {
+    if (++spins < RINGQ_SPINS) {
+      sched_yield();
+      continue;
+    }
+    unsigned int epoch = __atomic_load_n(&ring->slots_epoch, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&ring->idle_producers, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ringq_trypush(ring, item) == 0) {
+      __atomic_sub_fetch(&ring->idle_producers, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&ring->slots_epoch, epoch);
+    __atomic_sub_fetch(&ring->idle_producers, 1, __ATOMIC_RELAXED);
+  }
+
+  ringq_signal(&ring->items_epoch, &ring->idle_consumers);
+}
+
+ringq_item ringq_pop(ringq_t* ring){
+  ringq_item item;
+  int spins = 0;
+
+  while ((item = ringq_trypop(ring)) == NULL) {
+    if (++spins < RINGQ_SPINS) {
+      sched_yield();
+      continue;
+    }
+    unsigned int epoch = __atomic_load_n(&ring->items_epoch, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&ring->idle_consumers, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((item = ringq_trypop(ring)) != NULL) {
+      __atomic_sub_fetch(&ring->idle_consumers, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    futex_wait(&ring->items_epoch, epoch);
+    __atomic_sub_fetch(&ring->idle_consumers, 1, __ATOMIC_RELAXED);
+  }
+
+  ringq_signal(&ring->slots_epoch, &ring->idle_producers);
+  return item;
+}
+
+void ringq_destroy(ringq_t* ring){
+  free(ring->cells);
+  ring->cells = NULL;
+}
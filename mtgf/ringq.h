@@ -0,0 +1,57 @@
+#ifndef RINGQ_H
+#define RINGQ_H
+
+#include <stddef.h>
+
+/*
+ * Bounded multi-producer/multi-consumer ring of pointers.  Pushes and pops
+ * never take a lock; threads that find the ring empty (or full) spin
+ * briefly and then park on a futex until the other side makes progress.
+ */
+
+typedef void* ringq_item;
+
+typedef struct {
+  size_t seq;
+  ringq_item item;
+} ringq_cell_t;
+
+#define RINGQ_CACHELINE 64
+
+typedef struct {
+  ringq_cell_t* cells;
+  size_t mask;
+
+  /* Producers and consumers each get their own cache line */
+  char pad0[RINGQ_CACHELINE];
+  size_t enqueue_pos;
+  char pad1[RINGQ_CACHELINE];
+  size_t dequeue_pos;
+  char pad2[RINGQ_CACHELINE];
+
+  /* Futex words, bumped whenever a parked thread may need waking */
+  unsigned int items_epoch;
+  unsigned int slots_epoch;
+  int idle_consumers;
+  int idle_producers;
+} ringq_t;
+
+/* Initializes the ring; capacity is rounded up to a power of two */
+void ringq_init(ringq_t* ring, size_t capacity);
+
+/* Adds an element, returns 0 on success or -1 if the ring is full */
+int ringq_trypush(ringq_t* ring, ringq_item item);
+
+/* Removes the oldest element, returns NULL if the ring is empty */
+ringq_item ringq_trypop(ringq_t* ring);
+
+/* Adds an element, waiting for a free slot if the ring is full */
+void ringq_push(ringq_t* ring, ringq_item item);
+
+/* Removes the oldest element, waiting for one if the ring is empty */
+ringq_item ringq_pop(ringq_t* ring);
+
+/* Frees the ring storage; the ring must no longer be in use */
+void ringq_destroy(ringq_t* ring);
+
+#endif
@@ -1,6 +1,32 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "steque.h"
+#include "gf-student.h"
+
+/* Nodes are pushed and popped by different threads, all steques share a pool */
+static gf_pool_t node_pool;
+static pthread_once_t node_pool_once = PTHREAD_ONCE_INIT;
+
+static void node_pool_init(void){
+  if (gf_pool_init(&node_pool, sizeof(steque_node_t)) != 0){
+    fprintf(stderr, "Error: unable to set up the steque node pool.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static steque_node_t* node_alloc(void){
+  steque_node_t* node;
+
+  pthread_once(&node_pool_once, node_pool_init);
+  node = (steque_node_t*) gf_pool_get(&node_pool);
+  if (node == NULL){
+    fprintf(stderr, "Error: out of memory for a steque node.\n");
+    fflush(stderr);
+    exit(EXIT_FAILURE);
+  }
+  return node;
+}
 
 void steque_init(steque_t *queue){
   queue->front = NULL;
@@ -11,7 +37,7 @@ void steque_init(steque_t *queue){
 void steque_enqueue(steque_t* queue, steque_item item){
   steque_node_t* node;
 
-  node = (steque_node_t*) malloc(sizeof(steque_node_t));
+  node = node_alloc();
   node->item = item;
   node->next = NULL;
   
@@ -27,7 +53,7 @@ void steque_enqueue(steque_t* queue, steque_item item){
 void steque_push(steque_t* queue, steque_item item){
   steque_node_t* node;
 
-  node = (steque_node_t*) malloc(sizeof(steque_node_t));
+  node = node_alloc();
   node->item = item;
   node->next = queue->front;
 
@@ -61,7 +87,7 @@ steque_item steque_pop(steque_t* queue){
 
   queue->front = queue->front->next;
   if (queue->front == NULL) queue->back = NULL;
-  free(node);
+  gf_pool_put(&node_pool, node);
 
   queue->N--;
 
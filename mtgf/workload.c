@@ -1,21 +1,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
+#include <math.h>
 
 #include "workload.h"
 
-static char *gWorkloadPathArray[100];
-static unsigned short int gUniqueWorkloadPaths = 0;
+static char **gWorkloadPathArray = NULL;
+static double *gWorkloadTimes = NULL;     /* trace offsets, trace mode only */
+static double *gWorkloadCdf = NULL;       /* cumulative weights, normalized to 1 */
+static double *gWorkloadWeights = NULL;
+static unsigned int gUniqueWorkloadPaths = 0;
+static unsigned int gWorkloadCapacity = 0;
 
-static pthread_mutex_t counter_mutex;
 static int counter = 0;
 static int mode = WORKLOAD_SEQ;
+static double zipf_alpha = 1.0;
 
-int workload_init(char *workload_path) {
-  int i = 0;
-  char temp_buf[256];
+static __thread unsigned int rand_seed = 0;
 
+static void workload_add(char *path, double weight, double time) {
+  if (gUniqueWorkloadPaths == gWorkloadCapacity) {
+    gWorkloadCapacity = gWorkloadCapacity ? 2 * gWorkloadCapacity : 64;
+    gWorkloadPathArray = realloc(gWorkloadPathArray, gWorkloadCapacity * sizeof(char*));
+    gWorkloadWeights = realloc(gWorkloadWeights, gWorkloadCapacity * sizeof(double));
+    gWorkloadTimes = realloc(gWorkloadTimes, gWorkloadCapacity * sizeof(double));
+  }
+  gWorkloadPathArray[gUniqueWorkloadPaths] = strdup(path);
+  gWorkloadWeights[gUniqueWorkloadPaths] = weight;
+  gWorkloadTimes[gUniqueWorkloadPaths] = time;
+  gUniqueWorkloadPaths++;
+}
+
+/*
+ * Reads whitespace separated lines of the file.  With is_trace, each line
+ * is "<seconds> <path>"; otherwise it is "<path> [weight]", a missing
+ * weight counting as 1.  A file without any path is an error.
+ */
+static int workload_load(char *workload_path, int is_trace) {
+  char *line = NULL;
+  size_t line_cap = 0;
   FILE *file_handle;
 
   file_handle = fopen(workload_path, "r");
@@ -24,30 +47,145 @@ int workload_init(char *workload_path) {
     return EXIT_FAILURE;
   }
 
-  while (fscanf(file_handle, "%s", temp_buf) != EOF)
-    gWorkloadPathArray[i++] = strdup(temp_buf);
+  while (getline(&line, &line_cap, file_handle) != -1) {
+    char *ptr = line;
+    char *first = strtok_r(ptr, " \t\r\n", &ptr);
+    char *second = strtok_r(NULL, " \t\r\n", &ptr);
+    if (first == NULL)
+      continue;
+
+    if (is_trace) {
+      if (second == NULL) {
+        fprintf(stderr, "trace line without a path: %s\n", first);
+        continue;
+      }
+      workload_add(second, 1.0, atof(first));
+    } else {
+      double weight = second ? atof(second) : 1.0;
+      workload_add(first, weight > 0 ? weight : 0, 0);
+    }
+  }
+  free(line);
+  fclose(file_handle);
+
+  if (gUniqueWorkloadPaths == 0) {
+    fprintf(stderr, "no paths in workload file %s\n", workload_path);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
 
-  gUniqueWorkloadPaths = i;
+int workload_init(char *workload_path) {
+  return workload_load(workload_path, 0);
+}
 
-  pthread_mutex_init(&counter_mutex, NULL);
+int workload_init_trace(char *trace_path) {
+  if (workload_load(trace_path, 1) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  workload_set_mode(WORKLOAD_TRACE);
+  return EXIT_SUCCESS;
+}
 
-  fclose(file_handle);
+/* Builds the cumulative distribution sampled by the skewed modes */
+static void workload_build_cdf() {
+  double total = 0;
+
+  free(gWorkloadCdf);
+  gWorkloadCdf = malloc((gUniqueWorkloadPaths ? gUniqueWorkloadPaths : 1) * sizeof(double));
+  for (unsigned int i = 0; i < gUniqueWorkloadPaths; i++) {
+    /* Zipf ranks paths by their order in the workload file */
+    double weight = (mode == WORKLOAD_ZIPF) ? 1.0 / pow(i + 1, zipf_alpha) : gWorkloadWeights[i];
+    total += weight;
+    gWorkloadCdf[i] = total;
+  }
+  for (unsigned int i = 0; i < gUniqueWorkloadPaths; i++)
+    gWorkloadCdf[i] = total > 0 ? gWorkloadCdf[i] / total : (i + 1.0) / gUniqueWorkloadPaths;
+}
 
+int workload_set_mode(int new_mode) {
+  if (new_mode < WORKLOAD_SEQ || new_mode > WORKLOAD_TRACE)
+    return EXIT_FAILURE;
+
+  mode = new_mode;
+  if (mode == WORKLOAD_ZIPF || mode == WORKLOAD_WEIGHTED)
+    workload_build_cdf();
   return EXIT_SUCCESS;
 }
 
-unsigned short int workload_num_unique_paths(){
+void workload_set_zipf_alpha(double alpha) {
+  zipf_alpha = alpha;
+  if (mode == WORKLOAD_ZIPF)
+    workload_build_cdf();
+}
+
+unsigned int workload_num_unique_paths(){
   return gUniqueWorkloadPaths;
 }
 
-char* workload_get_path(){
+static double workload_uniform() {
+  if (rand_seed == 0)
+    rand_seed = (unsigned int) (size_t) &rand_seed ^ (unsigned int) rand();
+  return rand_r(&rand_seed) / (RAND_MAX + 1.0);
+}
+
+char* workload_get_entry(double *timestamp){
   int entry;
 
+  if (timestamp)
+    *timestamp = 0;
+
   if(mode == WORKLOAD_RND)
-    return gWorkloadPathArray[(int)(1.0 * gUniqueWorkloadPaths * rand()/(RAND_MAX+1.0))];
+    return gWorkloadPathArray[(int)(gUniqueWorkloadPaths * workload_uniform())];
+
+  if (mode == WORKLOAD_ZIPF || mode == WORKLOAD_WEIGHTED) {
+    /* First entry whose cumulative weight exceeds a uniform draw */
+    double u = workload_uniform();
+    unsigned int lo = 0, hi = gUniqueWorkloadPaths - 1;
+    while (lo < hi) {
+      unsigned int mid = lo + (hi - lo) / 2;
+      if (gWorkloadCdf[mid] > u)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    return gWorkloadPathArray[lo];
+  }
 
   entry = __sync_fetch_and_add(&counter, 1);
 
+  if (mode == WORKLOAD_TRACE && timestamp) {
+    /*
+     * Replaying past the end of the trace starts it over, one mean gap
+     * between requests after its last entry (or, for a single entry, as
+     * long after it as that entry was after the start)
+     */
+    unsigned int n = gUniqueWorkloadPaths;
+    unsigned int rounds = entry / n;
+    double first = gWorkloadTimes[0];
+    double last = gWorkloadTimes[n - 1];
+    double gap = n > 1 ? (last - first) / (n - 1) : first;
+    *timestamp = rounds * (last - first + gap) + gWorkloadTimes[entry % n];
+  }
+
   return gWorkloadPathArray[entry % gUniqueWorkloadPaths];
+}
 
-}
\ No newline at end of file
+char* workload_get_path(){
+  return workload_get_entry(NULL);
+}
+
+void workload_destroy(void) {
+  for (unsigned int index = 0; index < gUniqueWorkloadPaths; index++)
+    free(gWorkloadPathArray[index]);
+  free(gWorkloadPathArray);
+  free(gWorkloadWeights);
+  free(gWorkloadTimes);
+  free(gWorkloadCdf);
+  gWorkloadPathArray = NULL;
+  gWorkloadWeights = NULL;
+  gWorkloadTimes = NULL;
+  gWorkloadCdf = NULL;
+  gUniqueWorkloadPaths = 0;
+  gWorkloadCapacity = 0;
+}
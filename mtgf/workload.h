@@ -3,24 +3,48 @@
 
 #define WORKLOAD_SEQ 0
 #define WORKLOAD_RND 1
+#define WORKLOAD_ZIPF 2
+#define WORKLOAD_WEIGHTED 3
+#define WORKLOAD_TRACE 4
 
-/* 
+/*
  * Opens the file associated with the input argument
- * and reads in a list of paths to request. 
+ * and reads in a list of paths to request.  Each line holds
+ * a path, optionally followed by a weight used in
+ * WORKLOAD_WEIGHTED mode (Default: 1).  Fails if the file
+ * holds no path.
  */
 int workload_init(char *workload_path);
 
+/*
+ * Like workload_init, for a trace whose lines are
+ * "<seconds> <path>": the offset since the start of the trace
+ * at which the path was requested.  Selects WORKLOAD_TRACE.
+ */
+int workload_init_trace(char *trace_path);
+
 /*
  * Sets the mode.  If WORKLOAD_SEQ, then workload getpath will
  * return the paths in sequence.  If WORKLOAD_RND, then
  * the paths will be chosen uniformly at random with replacement.
+ * WORKLOAD_ZIPF picks the path of rank k (its position in the
+ * workload file, starting at 1) with probability proportional to
+ * 1/k^alpha, and WORKLOAD_WEIGHTED in proportion to its weight.
+ * WORKLOAD_TRACE replays the trace in order, starting over one
+ * mean request gap after its last entry.  Call it after the
+ * workload is loaded.
  */
 int workload_set_mode(int mode);
 
+/*
+ * Sets the skew of WORKLOAD_ZIPF (Default: 1.0).
+ */
+void workload_set_zipf_alpha(double alpha);
+
 /*
  * Returns the number of unique paths in the workload
  */
-unsigned short int workload_num_unique_paths();
+unsigned int workload_num_unique_paths();
 
 /*
  * Returns a path from the workload.  Whether this is
@@ -29,4 +53,16 @@ unsigned short int workload_num_unique_paths();
  */
 char* workload_get_path();
 
-#endif
\ No newline at end of file
+/*
+ * Like workload_get_path, also storing in timestamp the
+ * trace offset (in seconds) at which the path is due.  This
+ * is 0 in every mode but WORKLOAD_TRACE.
+ */
+char* workload_get_entry(double *timestamp);
+
+/*
+ * Frees the paths read by workload_init.
+ */
+void workload_destroy(void);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include "workq.h"
+
+void workq_init(workq_t* workq, int nworkers){
+  if (nworkers < 1)
+    nworkers = 1;
+
+  if (posix_memalign((void**) &workq->lanes, WORKQ_CACHELINE, nworkers * sizeof(workq_lane_t)) != 0)
+    abort();
+  for (int i = 0; i < nworkers; i++) {
+    workq_lane_t* lane = &workq->lanes[i];
+    pthread_mutex_init(&lane->lock, NULL);
+    pthread_cond_init(&lane->cond, NULL);
+    lane->capacity = 64;
+    lane->items = malloc(lane->capacity * sizeof(workq_item));
+    lane->head = 0;
+    lane->count = 0;
+    lane->sleeping = 0;
+  }
+  workq->nlanes = nworkers;
+  workq->next_lane = 0;
+  workq->nidle = 0;
+}
+
+/* Appends to the back of the lane; caller holds its lock.  The count is
+ * only changed under the lock, but atomically, since pushers and thieves
+ * peek at it without the lock */
+static void lane_append(workq_lane_t* lane, workq_item item){
+  if (lane->count == lane->capacity) {
+    workq_item* items = malloc(2 * lane->capacity * sizeof(workq_item));
+    for (size_t i = 0; i < lane->count; i++)
+      items[i] = lane->items[(lane->head + i) % lane->capacity];
+    free(lane->items);
+    lane->items = items;
+    lane->head = 0;
+    lane->capacity *= 2;
+  }
+  lane->items[(lane->head + lane->count) % lane->capacity] = item;
+  __atomic_add_fetch(&lane->count, 1, __ATOMIC_RELAXED);
+}
+
+static workq_item lane_take_front(workq_lane_t* lane){
+  workq_item item = lane->items[lane->head];
+  lane->head = (lane->head + 1) % lane->capacity;
+  __atomic_sub_fetch(&lane->count, 1, __ATOMIC_RELAXED);
+  return item;
+}
+
+static workq_item lane_take_back(workq_lane_t* lane){
+  size_t count = __atomic_sub_fetch(&lane->count, 1, __ATOMIC_RELAXED);
+  return lane->items[(lane->head + count) % lane->capacity];
+}
+
+/* Wakes the lane's worker if it sleeps; returns whether it did */
+static int lane_wake(workq_lane_t* lane){
+  int woken = 0;
+  pthread_mutex_lock(&lane->lock);
+  if (lane->sleeping) {
+    lane->sleeping = 0;
+    woken = 1;
+    pthread_cond_signal(&lane->cond);
+  }
+  pthread_mutex_unlock(&lane->lock);
+  return woken;
+}
+
+void workq_push(workq_t* workq, workq_item item){
+  // Two choices: the round-robin lane or the one after it, whichever is
+  // shorter.  The counts are read without locking, as a hint only.
+  unsigned int pick = __atomic_fetch_add(&workq->next_lane, 1, __ATOMIC_RELAXED) % workq->nlanes;
+  unsigned int other = (pick + 1) % workq->nlanes;
+  if (__atomic_load_n(&workq->lanes[other].count, __ATOMIC_RELAXED) <
+      __atomic_load_n(&workq->lanes[pick].count, __ATOMIC_RELAXED))
+    pick = other;
+
+  workq_lane_t* lane = &workq->lanes[pick];
+  pthread_mutex_lock(&lane->lock);
+  lane_append(lane, item);
+  int woken = lane->sleeping;
+  if (woken) {
+    lane->sleeping = 0;
+    pthread_cond_signal(&lane->cond);
+  }
+  pthread_mutex_unlock(&lane->lock);
+  if (woken)
+    return;
+
+  // The owner is busy: let an idle worker steal the item instead.  Pairs
+  // with the fence in workq_pop, so either that worker's last scan sees the
+  // item or this check sees the worker idle.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&workq->nidle, __ATOMIC_RELAXED) == 0)
+    return;
+  for (int i = 1; i < workq->nlanes; i++) {
+    if (lane_wake(&workq->lanes[(pick + i) % workq->nlanes]))
+      return;
+  }
+}
+
+/*
+ * Takes from the back of another lane, the end its owner is not using.
+ * Busy lanes are skipped at first, but if nothing else turns up they are
+ * waited for: a lane passed over here may hold the item whose push saw
+ * this worker idle and woke it.
+ */
+static workq_item workq_steal(workq_t* workq, int worker){
+  int contended = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 1; i < workq->nlanes; i++) {
+      workq_lane_t* victim = &workq->lanes[(worker + i) % workq->nlanes];
+      if (__atomic_load_n(&victim->count, __ATOMIC_RELAXED) == 0)
+        continue;
+      if (pass == 0) {
+        if (pthread_mutex_trylock(&victim->lock) != 0) {
+          contended = 1;
+          continue;
+        }
+      } else {
+        pthread_mutex_lock(&victim->lock);
+      }
+      workq_item item = victim->count > 0 ? lane_take_back(victim) : NULL;
+      pthread_mutex_unlock(&victim->lock);
+      if (item != NULL)
+        return item;
+    }
+    if (!contended)
+      break;
+  }
+  return NULL;
+}
+
+workq_item workq_pop(workq_t* workq, int worker){
+  workq_lane_t* lane = &workq->lanes[worker % workq->nlanes];
+  workq_item item;
+
+  while (1) {
+    pthread_mutex_lock(&lane->lock);
+    if (lane->count > 0) {
+      item = lane_take_front(lane);
+      pthread_mutex_unlock(&lane->lock);
+      return item;
+    }
+    lane->sleeping = 1;
+    pthread_mutex_unlock(&lane->lock);
+
+    __atomic_add_fetch(&workq->nidle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    item = workq_steal(workq, worker);
+
+    pthread_mutex_lock(&lane->lock);
+    if (item == NULL) {
+      while (lane->sleeping && lane->count == 0)
+        pthread_cond_wait(&lane->cond, &lane->lock);
+    }
+    lane->sleeping = 0;
+    pthread_mutex_unlock(&lane->lock);
+    __atomic_sub_fetch(&workq->nidle, 1, __ATOMIC_RELAXED);
+
+    if (item != NULL)
+      return item;
+  }
+}
+
+void workq_destroy(workq_t* workq){
+  for (int i = 0; i < workq->nlanes; i++) {
+    pthread_mutex_destroy(&workq->lanes[i].lock);
+    pthread_cond_destroy(&workq->lanes[i].cond);
+    free(workq->lanes[i].items);
+  }
+  free(workq->lanes);
+  workq->lanes = NULL;
+}
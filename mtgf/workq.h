@@ -0,0 +1,50 @@
+#ifndef WORKQ_H
+#define WORKQ_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Work-stealing pool queue: every worker owns a deque (a lane) guarded by
+ * its own lock.  Pushes go to the shorter of two lanes picked round-robin,
+ * a worker serves its own lane from the front and, once it runs dry,
+ * steals from the back of the others' before going to sleep.
+ */
+
+typedef void* workq_item;
+
+#define WORKQ_CACHELINE 64
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  workq_item* items;
+  size_t head;
+  size_t count;
+  size_t capacity;
+  int sleeping;
+} __attribute__((aligned(WORKQ_CACHELINE))) workq_lane_t;
+
+typedef struct {
+  workq_lane_t* lanes;
+  int nlanes;
+  unsigned int next_lane;
+  int nidle;
+} workq_t;
+
+/* Initializes the queue with one lane per worker */
+void workq_init(workq_t* workq, int nworkers);
+
+/* Adds an element to a lightly loaded lane and wakes a worker for it */
+void workq_push(workq_t* workq, workq_item item);
+
+/*
+ * Removes an element for the given worker (0 to nworkers - 1): from its
+ * own lane first, then stolen from another one, waiting if all are empty
+ */
+workq_item workq_pop(workq_t* workq, int worker);
+
+/* Frees the lanes; the queue must no longer be in use */
+void workq_destroy(workq_t* workq);
+
+#endif